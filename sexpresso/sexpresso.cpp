@@ -7,32 +7,258 @@
 #endif
 #include "sexpresso.hpp"
 
-#include <cctype>
-#include <stack>
+#include <iterator>
 #include <algorithm>
-#include <sstream>
+#include <utility>
 #include <array>
 #include <iostream>
+#include <functional>
+#include <cstdlib>
+#include <cstdio>
+#include <cerrno>
+#include <limits>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <cstring>
+#include <sstream>
+#include <locale>
 
 namespace sexpresso {
+	static auto escapeInto(std::string& dst, std::string const& str) -> void;
+
+	// Threads with the pool on, so the others don't have to touch node_pool at all
+	static std::atomic<unsigned> node_pool_users{0};
+
+	// Spare child arrays and strings of destroyed nodes, by capacity class: everything
+	// in class c has a capacity of at least 2^c
+	struct NodePool {
+		~NodePool() {
+			// nodes in statics can still be destroyed on this thread after this
+			if(this->enabled) node_pool_users.fetch_sub(1, std::memory_order_relaxed);
+			this->enabled = false;
+		}
+		bool enabled = false;
+		size_t bytes = 0; // held in the lists
+		std::array<std::vector<std::vector<Sexp>>, 48> arrays;
+		std::array<std::vector<std::string>, 48> strings;
+	};
+	static thread_local NodePool node_pool;
+	// Enough to take back a tree of about a million nodes, so parsing a document after
+	// dropping the last one doesn't have to allocate
+	static const auto max_pooled_bytes = size_t{64} << 20;
+	static const auto small_string_capacity = std::string{}.capacity();
+
+	static auto floorLog2(size_t n) -> size_t {
+		auto log = size_t{0};
+		while(n >>= 1) ++log;
+		return log;
+	}
+
+	static auto ceilLog2(size_t n) -> size_t {
+		return n <= 1 ? 0 : floorLog2(n - 1) + 1;
+	}
+
+	static auto poolActive() -> bool {
+		return node_pool_users.load(std::memory_order_relaxed) != 0 && node_pool.enabled;
+	}
+
+	// Whether the pool has room for bytes more
+	static auto poolTakes(size_t bytes) -> bool {
+		if(node_pool.bytes + bytes > max_pooled_bytes) return false;
+		node_pool.bytes += bytes;
+		return true;
+	}
+
+	// Hands an empty child array to the pool
+	static auto recycleArray(std::vector<Sexp>& children) -> void {
+		auto cap = children.capacity();
+		if(cap == 0 || !poolTakes(cap * sizeof(Sexp))) return;
+		node_pool.arrays[floorLog2(cap)].push_back(std::move(children));
+	}
+
+	// Hands the memory of a node that's going away to the pool. Its children have to
+	// be gone already.
+	static auto recycleNode(Sexp& node) -> void {
+		recycleArray(node.value.sexp);
+		auto cap = node.value.str.capacity();
+		if(cap > small_string_capacity && poolTakes(cap)) node_pool.strings[floorLog2(cap)].push_back(std::move(node.value.str));
+	}
+
+	// The spares in class floorLog2(size) may be big enough, the ones in ceilLog2(size)
+	// all are. Returns the list to take the last one from, or nullptr.
+	template<typename T>
+	static auto sparesFor(std::array<std::vector<T>, 48>& lists, size_t size) -> std::vector<T>* {
+		auto& same = lists[floorLog2(size)];
+		if(!same.empty() && same.back().capacity() >= size) return &same;
+		auto& bigger = lists[ceilLog2(size)];
+		return bigger.empty() ? nullptr : &bigger;
+	}
+
+	// Gives dst room for size characters from the pool, if it hasn't got it already
+	static auto pooledString(size_t size, std::string& dst) -> void {
+		if(size <= dst.capacity()) return;
+		auto spares = sparesFor(node_pool.strings, size);
+		if(spares == nullptr) return;
+		dst.swap(spares->back());
+		spares->pop_back();
+		node_pool.bytes -= dst.capacity();
+	}
+
+	// Gives an empty child array room for size children from the pool, if it has some
+	static auto pooledArray(size_t size, std::vector<Sexp>& dst) -> void {
+		if(size == 0) return;
+		auto spares = sparesFor(node_pool.arrays, size);
+		if(spares == nullptr) return;
+		dst.swap(spares->back());
+		spares->pop_back();
+		node_pool.bytes -= dst.capacity() * sizeof(Sexp);
+	}
+
+	// Moves full child arrays to a bigger spare one from the pool, if there is one
+	static auto growPooled(std::vector<Sexp>& children) -> void {
+		auto bigger = std::vector<Sexp>{};
+		pooledArray(std::max(size_t{4}, 2 * children.size()), bigger);
+		if(bigger.capacity() == 0) return;
+		for(auto& child : children) bigger.push_back(std::move(child));
+		children.swap(bigger);
+		bigger.clear();
+		recycleArray(bigger);
+	}
+
+	auto enableNodePool(bool enable) -> void {
+		if(enable == node_pool.enabled) return;
+		node_pool.enabled = enable;
+		if(enable) {
+			node_pool_users.fetch_add(1, std::memory_order_relaxed);
+			return;
+		}
+		node_pool_users.fetch_sub(1, std::memory_order_relaxed);
+		for(auto& spares : node_pool.arrays) std::vector<std::vector<Sexp>>{}.swap(spares);
+		for(auto& spares : node_pool.strings) std::vector<std::string>{}.swap(spares);
+		node_pool.bytes = 0;
+	}
+
 	Sexp::Sexp() {
 		this->kind = SexpValueKind::SEXP;
 	}
 	Sexp::Sexp(std::string const& strval) {
 		this->kind = SexpValueKind::STRING;
-		this->value.str = escape(strval);
+		if(poolActive()) pooledString(strval.size(), this->value.str);
+		escapeInto(this->value.str, strval);
+	}
+	// Copies the children of src into dst (which must have no children) using an
+	// explicit stack so that deeply nested trees don't overflow the call stack.
+	static auto copyChildren(Sexp& dst, std::vector<Sexp> const& src) -> void {
+		auto pending = std::vector<std::pair<Sexp*, std::vector<Sexp> const*>>{};
+		pending.emplace_back(&dst, &src);
+		while(!pending.empty()) {
+			auto* to = pending.back().first;
+			auto* from = pending.back().second;
+			pending.pop_back();
+			// reserve up front so the pointers pushed below stay valid
+			to->value.sexp.reserve(from->size());
+			for(auto& child : *from) {
+				to->value.sexp.push_back(Sexp::unescaped(child.value.str));
+				auto& copy = to->value.sexp.back();
+				copy.kind = child.kind;
+				copy.sorted = child.sorted;
+				if(!child.value.sexp.empty()) pending.emplace_back(&copy, &child.value.sexp);
+			}
+		}
 	}
+
 	Sexp::Sexp(std::vector<Sexp> const& sexpval) {
 		this->kind = SexpValueKind::SEXP;
-		this->value.sexp = sexpval;
+		copyChildren(*this, sexpval);
 	}
 
-	auto Sexp::addChild(Sexp sexp) -> void {
-		if(this->kind == SexpValueKind::STRING) {
-			this->kind = SexpValueKind::SEXP;
-			this->value.sexp.push_back(Sexp{std::move(this->value.str)});
+	Sexp::Sexp(Sexp const& other) : kind(other.kind), sorted(other.sorted) {
+		this->value.str = other.value.str;
+		copyChildren(*this, other.value.sexp);
+	}
+
+	// Recursive destruction is the fastest for ordinary trees, it's only deep ones
+	// that need to be flattened to avoid overflowing the call stack.
+	static const auto max_recursive_destroy_depth = 128u;
+	static thread_local auto destroy_depth = 0u;
+
+	Sexp::~Sexp() {
+		if(!this->value.sexp.empty()) this->destroyChildren();
+		if(poolActive()) recycleNode(*this);
+	}
+
+	auto Sexp::destroyChildren() -> void {
+		if(destroy_depth < max_recursive_destroy_depth) {
+			++destroy_depth;
+			this->value.sexp.clear();
+			--destroy_depth;
+			return;
+		}
+		// Flatten the rest of the subtree onto a heap allocated stack instead. Every
+		// node is emptied before it is destroyed, so the nested destructor calls
+		// return immediately.
+		auto pending = std::move(this->value.sexp);
+		while(!pending.empty()) {
+			auto node = std::move(pending.back());
+			pending.pop_back();
+			for(auto& child : node.value.sexp) pending.push_back(std::move(child));
+			node.value.sexp.clear();
+		}
+	}
+
+	auto Sexp::operator=(Sexp&& other) -> Sexp& {
+		// other may be one of this node's own descendants, which replacing the children
+		// destroys, so take it out of the tree first
+		auto tmp = Sexp{std::move(other)};
+		this->kind = tmp.kind;
+		this->sorted = tmp.sorted;
+		bumpTreeGeneration();
+		this->value.sexp = std::move(tmp.value.sexp);
+		this->value.str = std::move(tmp.value.str);
+		return *this;
+	}
+
+	auto Sexp::operator=(Sexp const& other) -> Sexp& {
+		if(this == &other) return *this;
+		auto copy = other;
+		*this = std::move(copy);
+		return *this;
+	}
+
+	// Orders children by headName, with the ones that have none first
+	static auto nameBefore(std::string const* a, std::string const* b) -> bool {
+		return b != nullptr && (a == nullptr || *a < *b);
+	}
+
+	static auto childBefore(Sexp const& a, Sexp const& b) -> bool;
+
+	// Where the sorted part of a list starts: an atom at the front is its head and
+	// stays there
+	static auto sortedBegin(Sexp const& sexp) -> size_t {
+		return !sexp.value.sexp.empty() && sexp.value.sexp[0].kind == SexpValueKind::STRING ? 1 : 0;
+	}
+
+	// Adds a child where it belongs, at the end or in order if the list is sorted
+	static auto insertChild(Sexp& parent, Sexp child) -> Sexp& {
+		if(parent.kind == SexpValueKind::STRING) {
+			parent.kind = SexpValueKind::SEXP;
+			parent.value.sexp.push_back(Sexp{std::move(parent.value.str)});
+		}
+		auto& children = parent.value.sexp;
+		if(children.size() == children.capacity() && poolActive()) growPooled(children);
+		auto first = sortedBegin(parent);
+		if(!parent.sorted || children.size() == first || !childBefore(child, children.back())) {
+			children.push_back(std::move(child));
+			return children.back();
 		}
-		this->value.sexp.push_back(std::move(sexp));
+		auto pos = std::upper_bound(children.begin() + first, children.end(), child, childBefore);
+		return *children.insert(pos, std::move(child));
+	}
+
+	auto Sexp::addChild(Sexp sexp) -> void {
+		bumpTreeGeneration();
+		insertChild(*this, std::move(sexp));
 	}
 
 	auto Sexp::addChild(std::string str) -> void {
@@ -44,10 +270,8 @@ namespace sexpresso {
 	}
 
 	auto Sexp::addExpression(std::string const& str) -> void {
-		auto err = std::string{};
-		auto sexp = parse(str, err);
-		if(!err.empty()) return;
-		for(auto&& c : sexp.value.sexp) this->addChild(std::move(c));
+		auto ignored_error = std::string{};
+		this->addExpression(str, ignored_error);
 	}
 
 	auto Sexp::childCount() const -> size_t {
@@ -75,14 +299,32 @@ namespace sexpresso {
 		return paths;
 	}
 
-	auto Sexp::getChildByPath(std::string const& path) -> Sexp* {
-		if(this->kind == SexpValueKind::STRING) return nullptr;
+	static auto namedChildren(Sexp& sexp, std::string const& name) -> std::pair<Sexp*, Sexp*>;
+
+	static auto findByPath(Sexp& root, std::string const& path) -> Sexp* {
+		if(root.kind == SexpValueKind::STRING) return nullptr;
 
 		auto paths = splitPathString(path);
 
-		auto* cur = this;
+		auto* cur = &root;
 		for(auto i = paths.begin(); i != paths.end();) {
 			auto start = i;
+			if(cur->sorted) {
+				if(i == paths.end() - 1 && sortedBegin(*cur) == 1 && cur->value.sexp[0].value.str == *i) return &cur->value.sexp[0];
+				auto range = namedChildren(*cur, *i);
+				for(auto child = range.first; child != range.second; ++child) {
+					if(child->kind == SexpValueKind::STRING) {
+						if(i == paths.end() - 1) return child;
+						continue;
+					}
+					cur = child;
+					++i;
+					break;
+				}
+				if(i == start) return nullptr;
+				if(i == paths.end()) return cur;
+				continue;
+			}
 			for(auto& child : cur->value.sexp) {
 				auto brk = false;
 				switch(child.kind) {
@@ -111,32 +353,98 @@ namespace sexpresso {
 		return nullptr;
 	}
 
-	static auto findChild(Sexp& sexp, std::string name) -> Sexp* {
+	auto Sexp::getChildByPath(std::string const& path) -> Sexp* {
+		return findByPath(*this, path);
+	}
+
+	auto Sexp::getChildByPath(std::string const& path) const -> const Sexp* {
+		return findByPath(const_cast<Sexp&>(*this), path); // findByPath doesn't modify anything
+	}
+
+	// The name createPath matches a node by: the head of a list, or a string itself
+	static auto headName(Sexp const& s) -> std::string const* {
+		switch(s.kind) {
+		case SexpValueKind::SEXP:
+			if(s.value.sexp.empty() || s.value.sexp[0].kind != SexpValueKind::STRING) return nullptr;
+			return &s.value.sexp[0].value.str;
+		case SexpValueKind::STRING:
+			return &s.value.str;
+		}
+		printShouldNeverReachHere();
+		return nullptr;
+	}
+
+	static auto childBefore(Sexp const& a, Sexp const& b) -> bool {
+		return nameBefore(headName(a), headName(b));
+	}
+
+	// The children of a sorted list called name, in their original order, not counting
+	// the head
+	static auto namedChildren(Sexp& sexp, std::string const& name) -> std::pair<Sexp*, Sexp*> {
+		auto& children = sexp.value.sexp;
+		auto first = std::lower_bound(children.begin() + sortedBegin(sexp), children.end(), name, [](Sexp const& child, std::string const& key) {
+			return nameBefore(headName(child), &key);
+		});
+		auto last = first;
+		while(last != children.end() && *headName(*last) == name) ++last;
+		return std::make_pair(children.data() + (first - children.begin()), children.data() + (last - children.begin()));
+	}
+
+	static auto findChild(Sexp& sexp, std::string const& name) -> Sexp* {
+		if(sexp.sorted) {
+			if(sortedBegin(sexp) == 1 && sexp.value.sexp[0].value.str == name) return &sexp.value.sexp[0];
+			auto range = namedChildren(sexp, name);
+			return range.first == range.second ? nullptr : range.first;
+		}
 		auto findPred = [&name](Sexp& s) {
-			switch(s.kind) {
-			case SexpValueKind::SEXP: {
-				if(s.childCount() == 0) return false;
-				auto& hd = s.getChild(0);
-				switch(hd.kind) {
-				case SexpValueKind::SEXP:
-					return false;
-				case SexpValueKind::STRING:
-					return hd.getString() == name;
-				}
-				break;
-			}
-			case SexpValueKind::STRING:
-				return s.getString() == name;
-			}
-			printShouldNeverReachHere();
-			return false;
+			auto hd = headName(s);
+			return hd != nullptr && *hd == name;
 		};
 		auto loc = std::find_if(sexp.value.sexp.begin(), sexp.value.sexp.end(), findPred);
 		if(loc == sexp.value.sexp.end()) return nullptr;
 		else return &(*loc);
 	}
-	
+
+	auto Sexp::sortChildren(unsigned threads) -> void {
+		if(this->kind != SexpValueKind::SEXP) return;
+		bumpTreeGeneration();
+		auto& children = this->value.sexp;
+		auto head = sortedBegin(*this);
+		auto count = children.size() - head;
+		// Sort runs of the children on separate threads, then merge pairs of neighbouring
+		// runs until there is one left
+		auto runs = size_t(parallelWorkers(count / 4096 + 1, threads));
+		auto bounds = std::vector<size_t>{};
+		for(auto r = size_t{0}; r <= runs; ++r) bounds.push_back(head + count * r / runs);
+		struct Context { std::vector<Sexp>* children; std::vector<size_t>* bounds; size_t step; };
+		auto context = Context{&children, &bounds, 1};
+		parallelFor(runs, [](void* c, unsigned, size_t r) {
+			auto& ctx = *static_cast<Context*>(c);
+			auto first = ctx.children->begin();
+			std::stable_sort(first + (*ctx.bounds)[r], first + (*ctx.bounds)[r + 1], childBefore);
+		}, &context, threads);
+		for(; context.step < runs; context.step *= 2) {
+			parallelFor((runs + 2 * context.step - 1) / (2 * context.step), [](void* c, unsigned, size_t m) {
+				auto& ctx = *static_cast<Context*>(c);
+				auto& bounds = *ctx.bounds;
+				auto first = ctx.children->begin();
+				auto lo = m * 2 * ctx.step;
+				auto mid = std::min(lo + ctx.step, bounds.size() - 1);
+				auto hi = std::min(lo + 2 * ctx.step, bounds.size() - 1);
+				std::inplace_merge(first + bounds[lo], first + bounds[mid], first + bounds[hi], childBefore);
+			}, &context, threads);
+		}
+		this->sorted = true;
+	}
+
+	auto recheckSorted(Sexp& list) -> void {
+		if(!list.sorted) return;
+		auto& children = list.value.sexp;
+		list.sorted = list.kind == SexpValueKind::SEXP && std::is_sorted(children.begin() + sortedBegin(list), children.end(), childBefore);
+	}
+
 	auto Sexp::createPath(std::vector<std::string> const& path) -> Sexp& {
+		bumpTreeGeneration();
 		auto el = this;
 		auto nxt = el;
 		auto pc = path.begin();
@@ -146,8 +454,7 @@ namespace sexpresso {
 			else el = nxt;
 		}
 		for(; pc != path.end(); ++pc) {
-			el->addChild(Sexp{std::vector<Sexp>{Sexp{*pc}}});
-			el = &(el->getChild(el->childCount()-1));
+			el = &insertChild(*el, Sexp{std::vector<Sexp>{Sexp{*pc}}});
 		}
 		return *el;
 	}
@@ -156,6 +463,164 @@ namespace sexpresso {
 		return this->createPath(splitPathString(path));
 	}
 
+	SexpPathIndex::SexpPathIndex(Sexp& root) : root(root) {
+		this->nodes.push_back(Node{0, 0, 0, 0, {}});
+	}
+
+	// Finds the slot in the index of parent holding the child called name, or the
+	// empty slot where it would go. Slots hold node ids plus one, 0 means empty.
+	static auto findSlot(SexpPathIndex& index, size_t parentid, Sexp const& parent, std::string const& name, size_t hash) -> size_t {
+		auto& slots = index.nodes[parentid].slots;
+		auto mask = slots.size() - 1;
+		for(auto i = hash & mask;; i = (i + 1) & mask) {
+			if(slots[i] == 0) return i;
+			auto& node = index.nodes[slots[i] - 1];
+			if(node.hash == hash && *headName(parent.value.sexp[node.childidx]) == name) return i;
+		}
+	}
+
+	static auto growSlots(SexpPathIndex& index, size_t parentid) -> void {
+		auto old = std::move(index.nodes[parentid].slots);
+		auto& slots = index.nodes[parentid].slots;
+		slots.assign(old.empty() ? 8 : old.size() * 2, 0);
+		auto mask = slots.size() - 1;
+		for(auto id : old) {
+			if(id == 0) continue;
+			auto i = index.nodes[id - 1].hash & mask;
+			while(slots[i] != 0) i = (i + 1) & mask;
+			slots[i] = id;
+		}
+	}
+
+	// Indexes the children added to parent since it was last looked at. Like
+	// findChild, the first child with a given name is the one that counts.
+	static auto catchUp(SexpPathIndex& index, size_t parentid, Sexp const& parent) -> void {
+		auto& children = parent.value.sexp;
+		for(; index.nodes[parentid].indexed < children.size(); ++index.nodes[parentid].indexed) {
+			auto childidx = index.nodes[parentid].indexed;
+			auto name = headName(children[childidx]);
+			if(name == nullptr) continue;
+			if((index.nodes[parentid].count + 1) * 2 > index.nodes[parentid].slots.size()) growSlots(index, parentid);
+			auto hash = std::hash<std::string>{}(*name);
+			auto slot = findSlot(index, parentid, parent, *name, hash);
+			if(index.nodes[parentid].slots[slot] != 0) continue;
+			index.nodes.push_back(SexpPathIndex::Node{childidx, hash, 0, 0, {}});
+			index.nodes[parentid].slots[slot] = index.nodes.size();
+			++index.nodes[parentid].count;
+		}
+	}
+
+	// Moves el and id one level down to the child called name, creating it if needed
+	static auto descend(SexpPathIndex& index, Sexp*& el, size_t& id, std::string const& name) -> void {
+		catchUp(index, id, *el);
+		auto hash = std::hash<std::string>{}(name);
+		auto slot = index.nodes[id].slots.empty() ? 0 : findSlot(index, id, *el, name, hash);
+		if(index.nodes[id].slots.empty() || index.nodes[id].slots[slot] == 0) {
+			el->addChild(Sexp{std::vector<Sexp>{Sexp{name}}});
+			catchUp(index, id, *el);
+			slot = findSlot(index, id, *el, name, hash);
+		}
+		id = index.nodes[id].slots[slot] - 1;
+		el = &el->value.sexp[index.nodes[id].childidx];
+	}
+
+	auto SexpPathIndex::createPath(std::vector<std::string> const& path) -> Sexp& {
+		bumpTreeGeneration();
+		auto el = &this->root;
+		auto id = size_t{0};
+		for(auto& name : path) descend(*this, el, id, name);
+		return *el;
+	}
+
+	auto SexpPathIndex::createPath(std::string const& path) -> Sexp& {
+		return this->createPath(splitPathString(path));
+	}
+
+	auto SexpPathIndex::createPaths(std::vector<std::vector<std::string>> const& paths) -> void {
+		bumpTreeGeneration();
+		// The nodes along the previous path. Only the last list on it has been
+		// changed since they were found, so the ones above it are still valid.
+		auto chain = std::vector<std::pair<Sexp*, size_t>>{};
+		chain.emplace_back(&this->root, 0);
+		auto prev = static_cast<std::vector<std::string> const*>(nullptr);
+		for(auto& path : paths) {
+			auto common = size_t{0};
+			if(prev != nullptr) {
+				while(common < prev->size() && common < path.size() && (*prev)[common] == path[common]) ++common;
+			}
+			chain.resize(common + 1);
+			auto el = chain.back().first;
+			auto id = chain.back().second;
+			for(auto i = path.begin() + common; i != path.end(); ++i) {
+				descend(*this, el, id, *i);
+				chain.emplace_back(el, id);
+			}
+			prev = &path;
+		}
+	}
+
+	// Trees only count their changes while there are caches to tell, so that trees
+	// changing on several threads don't fight over the counter otherwise
+	static std::atomic<size_t> path_caches{0};
+	static std::atomic<uint64_t> tree_generation{0};
+
+	auto treeGeneration() -> uint64_t {
+		return tree_generation.load(std::memory_order_relaxed);
+	}
+
+	auto bumpTreeGeneration() -> void {
+		if(path_caches.load(std::memory_order_relaxed) != 0) tree_generation.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	SexpPathCache::SexpPathCache(Sexp const& root) : root(root), generation(0), count(0) {
+		path_caches.fetch_add(1, std::memory_order_relaxed);
+		this->generation = treeGeneration();
+	}
+
+	SexpPathCache::SexpPathCache(SexpPathCache const& other)
+		: root(other.root), generation(other.generation), count(other.count), slots(other.slots) {
+		path_caches.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	SexpPathCache::~SexpPathCache() {
+		path_caches.fetch_sub(1, std::memory_order_relaxed);
+	}
+
+	auto SexpPathCache::getChildByPath(std::string const& path) -> Sexp const* {
+		if(this->generation != treeGeneration()) this->clear();
+		auto hash = std::hash<std::string>{}(path);
+		if(this->slots.empty()) this->slots.resize(16);
+		auto mask = this->slots.size() - 1;
+		auto i = hash & mask;
+		for(; this->slots[i].used; i = (i + 1) & mask) {
+			auto& entry = this->slots[i];
+			if(entry.hash == hash && entry.path == path) return entry.node;
+		}
+		auto node = this->root.getChildByPath(path);
+		// Keep the table at most half full
+		if(2 * (this->count + 1) > this->slots.size()) {
+			auto old = std::move(this->slots);
+			this->slots = std::vector<Entry>(old.size() * 2);
+			mask = this->slots.size() - 1;
+			for(auto& entry : old) {
+				if(!entry.used) continue;
+				auto j = entry.hash & mask;
+				while(this->slots[j].used) j = (j + 1) & mask;
+				this->slots[j] = std::move(entry);
+			}
+			for(i = hash & mask; this->slots[i].used; i = (i + 1) & mask) {}
+		}
+		this->slots[i] = Entry{true, hash, path, node};
+		++this->count;
+		return node;
+	}
+
+	auto SexpPathCache::clear() -> void {
+		for(auto& entry : this->slots) entry.used = false;
+		this->count = 0;
+		this->generation = treeGeneration();
+	}
+
 	auto Sexp::getChild(size_t idx) -> Sexp& {
 		return this->value.sexp[idx];
 	}
@@ -176,59 +641,135 @@ namespace sexpresso {
 	static const std::array<char, 11> escape_vals  = { '\'', '"', '\?', '\\', '\a', '\b', '\f', '\n', '\r', '\t', '\v' };
 	
 	static auto isEscapeValue(char c) -> bool {
-		return std::find(escape_vals.begin(), escape_vals.end(), c) != escape_vals.end();
+		return hasCharClass(c, char_escape_value);
 	}
 
 	static auto countEscapeValues(std::string const& str) -> size_t {
 		return std::count_if(str.begin(), str.end(), isEscapeValue);
 	}
 
-	static auto stringValToString(std::string const& s) -> std::string {
-		if(s.size() == 0) return std::string{"\"\""};
-		if((std::find(s.begin(), s.end(), ' ') == s.end()) && countEscapeValues(s) == 0) return s;
-		return ('"' + escape(s) + '"');
+	static auto appendStringVal(std::string& out, char const* first, char const* last) -> void {
+		if(first == last) {
+			out += "\"\"";
+			return;
+		}
+		if((std::find(first, last, ' ') == last) && std::none_of(first, last, isEscapeValue)) {
+			out.append(first, last);
+			return;
+		}
+		out.push_back('"');
+		for(auto i = first; i != last; ++i) {
+			auto loc = std::find(escape_vals.begin(), escape_vals.end(), *i);
+			if(loc == escape_vals.end()) out.push_back(*i);
+			else {
+				out.push_back('\\');
+				out.push_back(escape_chars[loc - escape_vals.begin()]);
+			}
+		}
+		out.push_back('"');
+	}
+
+	static auto appendStringVal(std::string& out, std::string const& s) -> void {
+		appendStringVal(out, s.data(), s.data() + s.size());
 	}
 
- static auto toStringImpl(Sexp const& sexp, std::ostringstream& ostream) -> void {
-		switch(sexp.kind) {
-		case SexpValueKind::STRING:
-			ostream << stringValToString(sexp.value.str);
-			break;
-		case SexpValueKind::SEXP:
-			switch(sexp.value.sexp.size()) {
-			case 0:
-				ostream << "()";
+	// Prints the nodes in [first, last) separated by spaces. Each frame is a list
+	// being printed as the range of children it has left and where it started.
+	static auto toStringImpl(Sexp const* first, Sexp const* last, std::string& out) -> void {
+		struct Frame { Sexp const* begin; Sexp const* next; Sexp const* end; };
+		auto frames = std::vector<Frame>{};
+		frames.push_back(Frame{first, first, last});
+		while(!frames.empty()) {
+			auto& frame = frames.back();
+			if(frame.next == frame.end) {
+				frames.pop_back();
+				if(!frames.empty()) out.push_back(')'); // the outermost list has no parentheses
+				continue;
+			}
+			if(frame.next != frame.begin) out.push_back(' ');
+			auto& child = *frame.next++;
+			switch(child.kind) {
+			case SexpValueKind::STRING:
+				appendStringVal(out, child.value.str);
 				break;
-			case 1:
-				ostream << '(';
-				toStringImpl(sexp.value.sexp[0], ostream);
-				ostream <<  ')';
+			case SexpValueKind::SEXP: {
+				out.push_back('(');
+				auto children = child.value.sexp.data();
+				frames.push_back(Frame{children, children, children + child.value.sexp.size()}); // invalidates frame
 				break;
-			default:
-				ostream << '(';
-				for(auto i = sexp.value.sexp.begin(); i != sexp.value.sexp.end(); ++i) {
-					toStringImpl(*i, ostream);
-					if(i != sexp.value.sexp.end()-1) ostream << ' ';
-				}
-				ostream << ')';
+			}
 			}
 		}
 	}
 
 	auto Sexp::toString() const -> std::string {
-		auto ostream = std::ostringstream{};
-		// outer sexp does not get surrounded by ()
+		auto out = std::string{};
 		switch(this->kind) {
 		case SexpValueKind::STRING:
-			ostream << stringValToString(this->value.str);
+			appendStringVal(out, this->value.str);
 			break;
 		case SexpValueKind::SEXP:
-			for(auto i = this->value.sexp.begin(); i != this->value.sexp.end(); ++i) {
-				toStringImpl(*i, ostream);
-				if(i != this->value.sexp.end()-1) ostream << ' ';
-			}
+			toStringImpl(this->value.sexp.data(), this->value.sexp.data() + this->value.sexp.size(), out);
+		}
+		return out;
+	}
+
+	// Roughly how many bytes toString will produce for the subtree
+	static auto estimateSize(Sexp const& sexp) -> size_t {
+		auto size = size_t{0};
+		auto pending = std::vector<Sexp const*>{&sexp};
+		while(!pending.empty()) {
+			auto& s = *pending.back();
+			pending.pop_back();
+			size += s.value.str.size() + 2;
+			for(auto& child : s.value.sexp) pending.push_back(&child);
+		}
+		return size;
+	}
+
+	auto Sexp::toStringParallel(unsigned threads) const -> std::string {
+		if(this->kind == SexpValueKind::STRING) return this->toString();
+		auto& children = this->value.sexp;
+		if(threads == 0) threads = std::max(1u, std::thread::hardware_concurrency());
+		if(threads > children.size()) threads = unsigned(children.size());
+		if(threads <= 1) return this->toString();
+
+		// Split the top level children into contiguous runs of about the same size
+		auto sizes = std::vector<size_t>(children.size());
+		auto total = size_t{0};
+		for(auto i = size_t{0}; i < children.size(); ++i) total += sizes[i] = estimateSize(children[i]);
+		auto bounds = std::vector<size_t>{0};
+		auto sofar = size_t{0};
+		for(auto i = size_t{0}; i < children.size() && bounds.size() < threads; ++i) {
+			sofar += sizes[i];
+			if(sofar >= total / threads * bounds.size()) bounds.push_back(i + 1);
+		}
+		bounds.push_back(children.size());
+
+		auto parts = std::vector<std::string>(bounds.size() - 1);
+		auto work = [&](size_t part) {
+			auto first = children.data() + bounds[part];
+			auto last = children.data() + bounds[part + 1];
+			auto estimate = size_t{0};
+			for(auto i = bounds[part]; i != bounds[part + 1]; ++i) estimate += sizes[i];
+			parts[part].reserve(estimate);
+			toStringImpl(first, last, parts[part]);
+		};
+		auto workers = std::vector<std::thread>{};
+		for(auto part = size_t{1}; part < parts.size(); ++part) workers.emplace_back(work, part);
+		work(0);
+		for(auto& w : workers) w.join();
+
+		auto out = std::string{};
+		auto length = parts.size();
+		for(auto& part : parts) length += part.size();
+		out.reserve(length);
+		for(auto& part : parts) {
+			if(part.empty()) continue;
+			if(!out.empty()) out.push_back(' ');
+			out += part;
 		}
-		return ostream.str();
+		return out;
 	}
 
 	auto Sexp::isString() const -> bool {
@@ -244,14 +785,29 @@ namespace sexpresso {
 	}
 
 	static auto childrenEqual(std::vector<Sexp> const& a, std::vector<Sexp> const& b) -> bool {
-		if(a.size() != b.size()) return false;
-
-		for(auto i = 0u; i < a.size(); ++i) {
-			if(!a[i].equal(b[i])) return false;
+		auto pending = std::vector<std::pair<std::vector<Sexp> const*, std::vector<Sexp> const*>>{};
+		pending.emplace_back(&a, &b);
+		while(!pending.empty()) {
+			auto& as = *pending.back().first;
+			auto& bs = *pending.back().second;
+			pending.pop_back();
+			if(as.size() != bs.size()) return false;
+			for(auto i = 0u; i < as.size(); ++i) {
+				if(as[i].kind != bs[i].kind) return false;
+				switch(as[i].kind) {
+				case SexpValueKind::SEXP:
+					if(!as[i].value.sexp.empty() || !bs[i].value.sexp.empty()) {
+						pending.emplace_back(&as[i].value.sexp, &bs[i].value.sexp);
+					}
+					break;
+				case SexpValueKind::STRING:
+					if(as[i].value.str != bs[i].value.str) return false;
+				}
+			}
 		}
 		return true;
 	}
-	
+
 	auto Sexp::equal(Sexp const& other) const -> bool {
 		if(this->kind != other.kind) return false;
 		switch(this->kind) {
@@ -265,6 +821,84 @@ namespace sexpresso {
 		return false;
 	}
 
+	auto Sexp::compare(Sexp const& other) const -> int {
+		// Pairs of nodes still to compare, in reverse order. A pair with lengths set stands
+		// for comparing the child counts of two lists, once all their common children
+		// turned out equal.
+		struct Pending {
+			Sexp const* a;
+			Sexp const* b;
+			bool lengths;
+		};
+		auto pending = std::vector<Pending>{};
+		auto a = this;
+		auto b = &other;
+		for(;;) {
+			if(a->kind != b->kind) return a->kind == SexpValueKind::STRING ? -1 : 1;
+			if(a->kind == SexpValueKind::STRING) {
+				auto cmp = a->value.str.compare(b->value.str);
+				if(cmp != 0) return cmp;
+			} else {
+				auto& as = a->value.sexp;
+				auto& bs = b->value.sexp;
+				pending.push_back(Pending{a, b, true});
+				for(auto i = std::min(as.size(), bs.size()); i-- > 0;) pending.push_back(Pending{&as[i], &bs[i], false});
+			}
+			for(;;) {
+				if(pending.empty()) return 0;
+				auto next = pending.back();
+				pending.pop_back();
+				if(!next.lengths) {
+					a = next.a;
+					b = next.b;
+					break;
+				}
+				auto asize = next.a->value.sexp.size();
+				auto bsize = next.b->value.sexp.size();
+				if(asize != bsize) return asize < bsize ? -1 : 1;
+			}
+		}
+	}
+
+	static auto hashCombine(size_t seed, size_t value) -> size_t {
+		return seed ^ (value + 0x9e3779b9 + (seed << 6) + (seed >> 2));
+	}
+
+	auto Sexp::hash() const -> size_t {
+		auto strhash = std::hash<std::string>{};
+		auto h = size_t{0};
+		// Pre-order walk on a fixed stack, only spilling to the heap for wide or deep
+		// trees, since hashing small keys is the common case
+		auto stack = std::array<Sexp const*, 64>{};
+		auto spill = std::vector<Sexp const*>{};
+		auto top = size_t{0};
+		stack[top++] = this;
+		while(top != 0 || !spill.empty()) {
+			auto node = spill.empty() ? stack[--top] : spill.back();
+			if(!spill.empty()) spill.pop_back();
+			// The child count in front of each list keeps different shapes with the same
+			// atoms apart
+			if(node->kind == SexpValueKind::STRING) {
+				h = hashCombine(h, strhash(node->value.str));
+				continue;
+			}
+			auto& children = node->value.sexp;
+			h = hashCombine(hashCombine(h, size_t(0x5e)), children.size());
+			for(auto i = children.size(); i-- > 0;) {
+				if(spill.empty() && top != stack.size()) stack[top++] = &children[i];
+				else spill.push_back(&children[i]);
+			}
+		}
+		return h;
+	}
+
+	auto Sexp::operator==(Sexp const& other) const -> bool { return this->equal(other); }
+	auto Sexp::operator!=(Sexp const& other) const -> bool { return !this->equal(other); }
+	auto Sexp::operator<(Sexp const& other) const -> bool { return this->compare(other) < 0; }
+	auto Sexp::operator<=(Sexp const& other) const -> bool { return this->compare(other) <= 0; }
+	auto Sexp::operator>(Sexp const& other) const -> bool { return this->compare(other) > 0; }
+	auto Sexp::operator>=(Sexp const& other) const -> bool { return this->compare(other) >= 0; }
+
 	auto Sexp::arguments() -> SexpArgumentIterator {
 		return SexpArgumentIterator{*this};
 	}
@@ -276,105 +910,1683 @@ namespace sexpresso {
 		return s;
 	}
 
-	auto parse(std::string const& str, std::string& err) -> Sexp {
-		auto sexprstack = std::stack<Sexp>{};
-		sexprstack.push(Sexp{}); // root
-		auto nextiter = str.begin();
-		for(auto iter = nextiter; iter != str.end(); iter = nextiter) {
-			nextiter = iter + 1;
-			if(std::isspace(*iter)) continue;
-			switch(*iter) {
-			case '(':
-				sexprstack.push(Sexp{});
-				break;
-			case ')': {
-				auto topsexp = std::move(sexprstack.top());
-				sexprstack.pop();
-				if(sexprstack.size() == 0) {
-					err = std::string{"too many ')' characters detected, closing sexprs that don't exist, no good."};
-					return Sexp{};
+	Lexer::Lexer(char const* begin, char const* end) : begin(begin), cur(begin), end(end) {}
+
+	Lexer::Lexer(std::string const& str) : Lexer(str.data(), str.data() + str.size()) {}
+
+	auto Lexer::fail(char const* pos, std::string msg) -> TokenKind {
+		this->errpos = pos;
+		this->err = std::move(msg);
+		return TokenKind::ERROR;
+	}
+
+	auto Lexer::skipSpace() -> void {
+		auto i = this->cur;
+		for(;;) {
+			for(; i != this->end && hasCharClass(*i, char_space); ++i) {}
+			if(i == this->end || *i != ';') break;
+			// the newline ending the comment is a space too
+			for(; i != this->end && !hasCharClass(*i, char_ends_comment); ++i) {}
+		}
+		this->cur = i;
+	}
+
+	auto Lexer::peek() -> TokenKind {
+		this->skipSpace();
+		if(this->cur == this->end) return TokenKind::END;
+		switch(*this->cur) {
+		case '(': return TokenKind::OPEN;
+		case ')': return TokenKind::CLOSE;
+		case '"': return TokenKind::STRING;
+		default: return TokenKind::SYMBOL;
+		}
+	}
+
+	auto Lexer::next() -> TokenKind {
+		this->skipSpace();
+		if(this->cur == this->end) return TokenKind::END;
+		this->tokbegin = this->cur;
+		switch(*this->cur) {
+		case '(':
+			this->tokend = ++this->cur;
+			return TokenKind::OPEN;
+		case ')':
+			this->tokend = ++this->cur;
+			return TokenKind::CLOSE;
+		case '"': {
+			auto start = this->cur + 1;
+			auto i = start;
+			for(; i != this->end; ++i) {
+				if(!hasCharClass(*i, char_string_special)) continue;
+				if(*i == '\\') {
+					if(++i == this->end) break;
+					continue;
 				}
-				auto& top = sexprstack.top();
-				top.addChild(std::move(topsexp));
-				break;
+				if(*i == '"') break;
+				if(*i == '\n') return this->fail(i, "Unexpected newline in string literal");
 			}
-			case '"': {
-				auto i = iter+1;
-				auto start = i;
-				for(; i != str.end(); ++i) {
-					if(*i == '\\') { ++i; continue; }
-					if(*i == '"') break;
-					if(*i == '\n') {
-						err = std::string{"Unexpected newline in string literal"};
-						return Sexp{};
-					}
+			if(i == this->end) return this->fail(this->cur, "Unterminated string literal");
+			for(auto it = start; it != i; ++it) {
+				if(*it != '\\') continue;
+				if(++it == i) return this->fail(it - 1, "Unfinished escape sequence at the end of the string");
+				if(!hasCharClass(*it, char_escape_char)) {
+					return this->fail(it - 1, std::string{"invalid escape char '"} + *it + '\'');
 				}
-				if(i == str.end()) {
-					err = std::string{"Unterminated string literal"};
-					return Sexp{};
-				}
-				auto resultstr = std::string{};
-				resultstr.reserve(i - start);
-				for(auto it = start; it != i; ++it) {
-					switch(*it) {
-					case '\\': {
-						++it;
-						if(it == i) {
-							err = std::string{"Unfinished escape sequence at the end of the string"};
-							return Sexp{};
-						}
-						auto pos = std::find(escape_chars.begin(), escape_chars.end(), *it);
-						if(pos == escape_chars.end()) {
-							err = std::string{"invalid escape char '"} + *it + '\'';
-							return Sexp{};
-						}
-						resultstr.push_back(escape_vals[pos - escape_chars.begin()]);
-						break;
-					}
-					default:
-						resultstr.push_back(*it);
-					}
+			}
+			this->tokbegin = start;
+			this->tokend = i;
+			this->cur = i + 1;
+			return TokenKind::STRING;
+		}
+		default: {
+			auto i = this->cur + 1; // neither a space nor a parenthesis, skipSpace and the cases above saw to that
+			for(; i != this->end && !hasCharClass(*i, char_ends_symbol); ++i) {}
+			this->cur = this->tokend = i;
+			return TokenKind::SYMBOL;
+		}
+		}
+	}
+
+	auto Lexer::tokenIs(char const* str) const -> bool {
+		auto i = this->tokbegin;
+		for(; i != this->tokend && *str != '\0'; ++i, ++str) {
+			if(*i != *str) return false;
+		}
+		return i == this->tokend && *str == '\0';
+	}
+
+	auto Lexer::skipList() -> bool {
+		for(auto depth = 1u; depth != 0;) {
+			switch(this->next()) {
+			case TokenKind::OPEN: ++depth; break;
+			case TokenKind::CLOSE: --depth; break;
+			case TokenKind::END:
+				this->fail(this->cur, "not enough s-expressions were closed by the end of parsing");
+				return false;
+			case TokenKind::ERROR: return false;
+			default: break;
+			}
+		}
+		return true;
+	}
+
+	// Unescapes the contents of a string literal the lexer has already validated.
+	static auto unescapeInto(std::string& dst, char const* first, char const* last) -> void {
+		dst.clear();
+		dst.reserve(last - first);
+		for(auto it = first; it != last; ++it) {
+			if(*it == '\\') {
+				++it;
+				dst.push_back(escape_vals[std::find(escape_chars.begin(), escape_chars.end(), *it) - escape_chars.begin()]);
+			} else {
+				dst.push_back(*it);
+			}
+		}
+	}
+
+	// Symbols are stored escaped, the same way Sexp(std::string const&) stores them.
+	static auto symbolSexp(char const* first, char const* last) -> Sexp {
+		auto str = std::string{};
+		if(poolActive()) pooledString(size_t(last - first), str);
+		str.assign(first, last);
+		if(countEscapeValues(str) != 0) str = escape(str);
+		return Sexp::unescaped(std::move(str));
+	}
+
+	// The contents of a string literal, unescaped
+	static auto stringSexp(char const* first, char const* last) -> Sexp {
+		auto str = std::string{};
+		if(poolActive()) pooledString(size_t(last - first), str);
+		unescapeInto(str, first, last);
+		return Sexp::unescaped(std::move(str));
+	}
+
+	// Only called on the error path, so the fast path never has to count lines.
+	// Finds the innermost '(' that is still open at the end of the input.
+	static auto findUnclosed(char const* begin, char const* end) -> char const* {
+		auto lexer = Lexer{begin, end};
+		auto opens = std::vector<char const*>{};
+		for(auto tok = lexer.next(); tok != TokenKind::END && tok != TokenKind::ERROR; tok = lexer.next()) {
+			if(tok == TokenKind::OPEN) opens.push_back(lexer.tokbegin);
+			else if(tok == TokenKind::CLOSE && !opens.empty()) opens.pop_back();
+		}
+		return opens.empty() ? end : opens.back();
+	}
+
+	// Moves the children collected since the list opened at start into a vector of
+	// exactly the right size, so lists never grow one push_back at a time.
+	static auto takeChildren(std::vector<Sexp>& nodes, size_t start, std::vector<Sexp>& into) -> void {
+		if(poolActive()) pooledArray(nodes.size() - start, into);
+		into.assign(std::make_move_iterator(nodes.begin() + start), std::make_move_iterator(nodes.end()));
+		nodes.erase(nodes.begin() + start, nodes.end());
+	}
+
+	// On success the top level nodes are left in parser.nodes for the caller to take.
+	template<bool TrackSpans>
+	static auto parseNodes(Parser& parser, std::string const& str, std::string& err, size_t& erroffset, std::vector<SexpSpan>* spans) -> bool {
+		parser.reset();
+		auto& nodes = parser.nodes;
+		auto& frames = parser.frames;
+		auto& openspans = parser.openspans;
+		auto begin = str.data();
+		auto lexer = Lexer{begin, begin + str.size()};
+		if(TrackSpans) {
+			spans->clear();
+			spans->push_back(SexpSpan{0, str.size()});
+		}
+		for(;;) {
+			auto tok = lexer.next();
+			if(TrackSpans && (tok == TokenKind::OPEN || tok == TokenKind::SYMBOL || tok == TokenKind::STRING)) {
+				auto spanbegin = size_t(lexer.tokbegin - begin);
+				if(tok == TokenKind::STRING) --spanbegin; // include the quotes
+				if(tok == TokenKind::OPEN) openspans.push_back(spans->size());
+				spans->push_back(SexpSpan{spanbegin, size_t(lexer.cur - begin)});
+			}
+			switch(tok) {
+			case TokenKind::OPEN:
+				frames.push_back(nodes.size());
+				break;
+			case TokenKind::CLOSE: {
+				if(frames.empty()) {
+					err = std::string{"too many ')' characters detected, closing sexprs that don't exist, no good."};
+					erroffset = lexer.tokbegin - begin;
+					parser.reset();
+					return false;
 				}
-				sexprstack.top().addChildUnescaped(std::move(resultstr));
-				nextiter = i + 1;
+				if(TrackSpans) {
+					(*spans)[openspans.back()].end = lexer.cur - begin;
+					openspans.pop_back();
+				}
+				auto list = Sexp{};
+				takeChildren(nodes, frames.back(), list.value.sexp);
+				frames.pop_back();
+				nodes.push_back(std::move(list));
 				break;
 			}
-			case ';':
-				for(; nextiter != str.end() && *nextiter != '\n' && *nextiter != '\r'; ++nextiter) {}
-				for(; nextiter != str.end() && (*nextiter == '\n' || *nextiter == '\r'); ++nextiter) {}
+			case TokenKind::SYMBOL:
+				nodes.push_back(symbolSexp(lexer.tokbegin, lexer.tokend));
+				break;
+			case TokenKind::STRING:
+				nodes.push_back(stringSexp(lexer.tokbegin, lexer.tokend));
 				break;
-			default:
-				auto symend = std::find_if(iter, str.end(), [](char const& c) { return std::isspace(c) || c == ')' || c == '('; });
-				auto& top = sexprstack.top();
-				top.addChild(Sexp{std::string{iter, symend}});
-				nextiter = symend;
+			case TokenKind::ERROR:
+				err = std::move(lexer.err);
+				erroffset = lexer.errpos - begin;
+				parser.reset();
+				return false;
+			case TokenKind::END: {
+				if(!frames.empty()) {
+					err = std::string{"not enough s-expressions were closed by the end of parsing"};
+					erroffset = findUnclosed(lexer.begin, lexer.end) - begin;
+					parser.reset();
+					return false;
+				}
+				return true;
+			}
 			}
 		}
-		if(sexprstack.size() != 1) {
-			err = std::string{"not enough s-expressions were closed by the end of parsing"};
-			return Sexp{};
+	}
+
+	template<bool TrackSpans>
+	static auto parseImpl(Parser& parser, std::string const& str, std::string& err, size_t& erroffset, std::vector<SexpSpan>* spans) -> Sexp {
+		auto root = Sexp{};
+		if(parseNodes<TrackSpans>(parser, str, err, erroffset, spans)) takeChildren(parser.nodes, 0, root.value.sexp);
+		return root;
+	}
+
+	auto Sexp::addExpression(std::string const& str, std::string& err) -> void {
+		auto parser = Parser{};
+		auto erroffset = std::string::npos;
+		if(!parseNodes<false>(parser, str, err, erroffset, nullptr)) return;
+		auto& nodes = parser.nodes;
+		if(nodes.empty()) return;
+		if(this->sorted) {
+			for(auto& node : nodes) this->addChild(std::move(node));
+			return;
 		}
-		return std::move(sexprstack.top());
+		// the first addChild turns a string node into a list, so reserve after it
+		this->addChild(std::move(nodes.front()));
+		this->value.sexp.reserve(this->value.sexp.size() + nodes.size() - 1);
+		for(auto i = nodes.begin() + 1; i != nodes.end(); ++i) this->value.sexp.push_back(std::move(*i));
 	}
 
-	auto parse(std::string const& str) -> Sexp {
+	auto Parser::parse(std::string const& str, std::string& err) -> Sexp {
+		auto erroffset = std::string::npos;
+		return parseImpl<false>(*this, str, err, erroffset, nullptr);
+	}
+
+	auto Parser::parse(std::string const& str) -> Sexp {
 		auto ignored_error = std::string{};
-		return parse(str, ignored_error);
+		return this->parse(str, ignored_error);
 	}
 
-	auto escape(std::string const& str) -> std::string {
+	auto Parser::parse(std::string const& str, std::string& err, SexpPosition& errpos) -> Sexp {
+		auto erroffset = std::string::npos;
+		auto sexp = parseImpl<false>(*this, str, err, erroffset, nullptr);
+		if(erroffset != std::string::npos) errpos = positionOf(str, erroffset);
+		return sexp;
+	}
+
+	auto Parser::parse(std::string const& str, std::string& err, SexpPosition& errpos, std::vector<SexpSpan>& spans) -> Sexp {
+		auto erroffset = std::string::npos;
+		auto sexp = parseImpl<true>(*this, str, err, erroffset, &spans);
+		if(erroffset != std::string::npos) {
+			errpos = positionOf(str, erroffset);
+			spans.clear();
+		}
+		return sexp;
+	}
+
+	// Returns the child at idx of parent, appending a new one if parent has run out
+	// of children to overwrite.
+	static auto reuseChild(Sexp& parent, size_t idx) -> Sexp& {
+		auto& children = parent.value.sexp;
+		if(idx == children.size()) {
+			if(children.size() == children.capacity() && poolActive()) growPooled(children);
+			children.emplace_back();
+		}
+		return children[idx];
+	}
+
+	// Drops the children past count, keeping the vector's capacity.
+	static auto truncateChildren(Sexp& sexp, size_t count) -> void {
+		sexp.value.sexp.erase(sexp.value.sexp.begin() + count, sexp.value.sexp.end());
+	}
+
+	auto Parser::parseInto(Sexp& target, std::string const& str, std::string& err) -> void {
+		this->parseInto(target, str.data(), str.data() + str.size(), err);
+	}
+
+	auto Parser::parseInto(Sexp& target, char const* begin, char const* end, std::string& err) -> void {
+		this->reset();
+		auto& frames = this->frames;
+		auto& targets = this->targets;
+		auto lexer = Lexer{begin, end};
+		target.kind = SexpValueKind::SEXP;
+		target.sorted = false;
+		bumpTreeGeneration();
+		target.value.str.clear();
+		targets.push_back(&target);
+		frames.push_back(0);
+		for(;;) {
+			auto tok = lexer.next();
+			switch(tok) {
+			case TokenKind::OPEN: {
+				auto& list = reuseChild(*targets.back(), frames.back()++);
+				list.kind = SexpValueKind::SEXP;
+				list.sorted = false;
+				list.value.str.clear();
+				targets.push_back(&list);
+				frames.push_back(0);
+				break;
+			}
+			case TokenKind::CLOSE:
+				if(targets.size() == 1) {
+					err = std::string{"too many ')' characters detected, closing sexprs that don't exist, no good."};
+					this->reset();
+					target = Sexp{};
+					return;
+				}
+				truncateChildren(*targets.back(), frames.back());
+				targets.pop_back();
+				frames.pop_back();
+				break;
+			case TokenKind::SYMBOL: {
+				auto& atom = reuseChild(*targets.back(), frames.back()++);
+				atom.kind = SexpValueKind::STRING;
+				atom.sorted = false;
+				atom.value.sexp.clear();
+				if(poolActive()) pooledString(size_t(lexer.tokend - lexer.tokbegin), atom.value.str);
+				atom.value.str.assign(lexer.tokbegin, lexer.tokend);
+				if(countEscapeValues(atom.value.str) != 0) atom.value.str = escape(atom.value.str);
+				break;
+			}
+			case TokenKind::STRING: {
+				auto& atom = reuseChild(*targets.back(), frames.back()++);
+				atom.kind = SexpValueKind::STRING;
+				atom.sorted = false;
+				atom.value.sexp.clear();
+				if(poolActive()) pooledString(size_t(lexer.tokend - lexer.tokbegin), atom.value.str);
+				unescapeInto(atom.value.str, lexer.tokbegin, lexer.tokend);
+				break;
+			}
+			case TokenKind::ERROR:
+				err = std::move(lexer.err);
+				this->reset();
+				target = Sexp{};
+				return;
+			case TokenKind::END:
+				if(targets.size() != 1) {
+					err = std::string{"not enough s-expressions were closed by the end of parsing"};
+					this->reset();
+					target = Sexp{};
+					return;
+				}
+				truncateChildren(target, frames.back());
+				this->reset();
+				return;
+			}
+		}
+	}
+
+	auto Parser::reset() -> void {
+		this->nodes.clear();
+		this->frames.clear();
+		this->openspans.clear();
+		this->targets.clear();
+	}
+
+	auto parse(std::string const& str, std::string& err) -> Sexp {
+		auto parser = Parser{};
+		return parser.parse(str, err);
+	}
+
+	auto parse(std::string const& str, std::string& err, SexpPosition& errpos) -> Sexp {
+		auto parser = Parser{};
+		return parser.parse(str, err, errpos);
+	}
+
+	auto parse(std::string const& str, std::string& err, SexpPosition& errpos, std::vector<SexpSpan>& spans) -> Sexp {
+		auto parser = Parser{};
+		return parser.parse(str, err, errpos, spans);
+	}
+
+	auto positionOf(std::string const& str, size_t offset) -> SexpPosition {
+		auto pos = SexpPosition{offset, 1, 1};
+		auto end = str.begin() + std::min(offset, str.size());
+		for(auto i = str.begin(); i != end; ++i) {
+			if(*i == '\n') {
+				++pos.line;
+				pos.column = 1;
+			} else {
+				++pos.column;
+			}
+		}
+		return pos;
+	}
+
+	auto parse(std::string const& str) -> Sexp {
+		auto ignored_error = std::string{};
+		return parse(str, ignored_error);
+	}
+
+	// Spans are in pre-order, so they are sorted by where they begin and a node's
+	// descendants are the spans right after it that begin before it ends. Subtrees
+	// are mostly small, so gallop forward before the binary search.
+	static auto subtreeEnd(std::vector<SexpSpan> const& spans, size_t node) -> size_t {
+		auto end = spans[node].end;
+		auto first = node + 1;
+		auto step = size_t{1};
+		while(first + step < spans.size() && spans[first + step].begin < end) {
+			first += step;
+			step *= 2;
+		}
+		auto last = std::min(first + step, spans.size());
+		return std::lower_bound(spans.begin() + first, spans.begin() + last, end, [](SexpSpan const& span, size_t pos) {
+			return span.begin < pos;
+		}) - spans.begin();
+	}
+
+	// A list on the way from the root to the edit
+	struct ReparseLevel {
+		Sexp* node;
+		size_t span; // index of its span
+		size_t start; // where the text after its last kept child starts
+		size_t kept; // children that end before the edit
+		size_t next; // span index of the first child that isn't kept
+	};
+
+	// Parses the children of level's list from level.start until the list closes,
+	// or until a child begins where an old child that comes after the edit begins now,
+	// from where on the old children are still right. On success the new children are
+	// in parser.nodes and their spans in fresh, and resume and resumeidx are the span
+	// index and child index of the first old child to keep. Fails if the list's
+	// brackets don't balance any more.
+	static auto reparseLevel(Parser& parser, std::string const& text, std::vector<SexpSpan> const& spans, SexpEdit const& edit,
+	                         ReparseLevel const& level, std::vector<SexpSpan>& fresh, size_t& resume, size_t& resumeidx) -> bool {
+		parser.reset();
+		fresh.clear();
+		auto& nodes = parser.nodes;
+		auto& frames = parser.frames;
+		auto& openspans = parser.openspans;
+		auto delta = edit.inserted.size() - edit.removed; // wraps around when shrinking, as do the sums using it
+		auto isroot = level.span == 0;
+		auto close = isroot ? std::string::npos : spans[level.span].end - 1 + delta;
+		auto listend = subtreeEnd(spans, level.span);
+		auto editend = edit.offset + edit.inserted.size(); // in the new text
+		resume = level.next;
+		resumeidx = level.kept;
+		auto begin = text.data();
+		auto lexer = Lexer{begin + level.start, begin + text.size()};
+		for(;;) {
+			auto tok = lexer.next();
+			if(tok == TokenKind::OPEN || tok == TokenKind::SYMBOL || tok == TokenKind::STRING) {
+				auto spanbegin = size_t(lexer.tokbegin - begin);
+				if(tok == TokenKind::STRING) --spanbegin;
+				if(frames.empty() && spanbegin >= editend) {
+					auto old = spanbegin - delta;
+					while(resume != listend && spans[resume].begin < old) {
+						resume = subtreeEnd(spans, resume);
+						++resumeidx;
+					}
+					if(resume != listend && spans[resume].begin == old) return true;
+				}
+				if(tok == TokenKind::OPEN) openspans.push_back(fresh.size());
+				fresh.push_back(SexpSpan{spanbegin, size_t(lexer.cur - begin)});
+			}
+			switch(tok) {
+			case TokenKind::OPEN:
+				frames.push_back(nodes.size());
+				break;
+			case TokenKind::CLOSE: {
+				if(frames.empty()) {
+					if(size_t(lexer.tokbegin - begin) != close) return false;
+					resume = listend;
+					resumeidx = level.node->value.sexp.size();
+					return true;
+				}
+				fresh[openspans.back()].end = lexer.cur - begin;
+				openspans.pop_back();
+				auto list = Sexp{};
+				takeChildren(nodes, frames.back(), list.value.sexp);
+				frames.pop_back();
+				nodes.push_back(std::move(list));
+				break;
+			}
+			case TokenKind::SYMBOL:
+				nodes.push_back(symbolSexp(lexer.tokbegin, lexer.tokend));
+				break;
+			case TokenKind::STRING:
+				nodes.push_back(stringSexp(lexer.tokbegin, lexer.tokend));
+				break;
+			case TokenKind::ERROR:
+				return false;
+			case TokenKind::END:
+				if(!frames.empty() || !isroot) return false;
+				resume = listend;
+				resumeidx = level.node->value.sexp.size();
+				return true;
+			}
+		}
+	}
+
+	auto reparse(std::string& text, Sexp& tree, std::vector<SexpSpan>& spans, SexpEdit const& edit, std::string& err) -> void {
+		auto oldsize = text.size();
+		text.replace(edit.offset, edit.removed, edit.inserted);
+		auto errpos = SexpPosition{};
+		if(spans.empty() || spans[0].end != oldsize) {
+			tree = parse(text, err, errpos, spans);
+			return;
+		}
+		auto editend = edit.offset + edit.removed; // in the old text
+		// Go down through the lists whose brackets are clear of the edit
+		auto levels = std::vector<ReparseLevel>{};
+		auto level = ReparseLevel{&tree, 0, 0, 0, 1};
+		for(;;) {
+			auto& children = level.node->value.sexp;
+			auto descend = false;
+			for(; level.kept != children.size(); ++level.kept) {
+				auto& span = spans[level.next];
+				if(span.end >= edit.offset) {
+					descend = children[level.kept].kind == SexpValueKind::SEXP && span.begin < edit.offset && editend < span.end;
+					break;
+				}
+				level.start = span.end;
+				level.next = subtreeEnd(spans, level.next);
+			}
+			levels.push_back(level);
+			if(!descend) break;
+			level = ReparseLevel{&children[level.kept], level.next, spans[level.next].begin + 1, 0, level.next + 1};
+		}
+		// and back up until one of them still balances
+		auto parser = Parser{};
+		auto fresh = std::vector<SexpSpan>{};
+		auto resume = size_t{0};
+		auto resumeidx = size_t{0};
+		auto l = levels.size();
+		while(l != 0 && !reparseLevel(parser, text, spans, edit, levels[l - 1], fresh, resume, resumeidx)) --l;
+		if(l == 0) {
+			tree = parse(text, err, errpos, spans);
+			return;
+		}
+		auto& found = levels[l - 1];
+		auto& nodes = parser.nodes;
+		auto& children = found.node->value.sexp;
+		auto replaced = resumeidx - found.kept;
+		auto common = std::min(replaced, nodes.size());
+		std::move(nodes.begin(), nodes.begin() + common, children.begin() + found.kept);
+		if(replaced > common) {
+			children.erase(children.begin() + found.kept + common, children.begin() + resumeidx);
+		} else {
+			children.insert(children.begin() + found.kept + common, std::make_move_iterator(nodes.begin() + common), std::make_move_iterator(nodes.end()));
+		}
+		auto delta = edit.inserted.size() - edit.removed;
+		auto oldspans = resume - found.next;
+		auto commonspans = std::min(oldspans, fresh.size());
+		std::copy(fresh.begin(), fresh.begin() + commonspans, spans.begin() + found.next);
+		if(oldspans > commonspans) {
+			spans.erase(spans.begin() + found.next + commonspans, spans.begin() + resume);
+		} else {
+			spans.insert(spans.begin() + found.next + commonspans, fresh.begin() + commonspans, fresh.end());
+		}
+		for(auto i = found.next + fresh.size(); i != spans.size(); ++i) {
+			spans[i].begin += delta;
+			spans[i].end += delta;
+		}
+		// The new children, or a head changed further down, can be out of order now
+		for(auto i = size_t{0}; i != l; ++i) {
+			spans[levels[i].span].end += delta;
+			recheckSorted(*levels[i].node);
+		}
+		bumpTreeGeneration();
+		parser.reset();
+	}
+
+	constexpr uint32_t FlatSexp::npos;
+
+	// Node ids are uint32_t with npos left out, and so are the offsets into the pool
+	static const auto flat_max_nodes = size_t{FlatSexp::npos};
+	static const auto flat_max_pool = size_t{std::numeric_limits<uint32_t>::max()};
+
+	static auto flatTooBig(std::string& err) -> FlatSexp {
+		err = std::string{"too big for a FlatSexp, it holds fewer than 2^32 nodes and at most 4 GiB of atoms"};
+		return FlatSexp{};
+	}
+
+	auto parseFlat(std::string const& str, std::string& err) -> FlatSexp {
+		auto flat = FlatSexp{};
+		auto lexer = Lexer{str};
+		auto open = std::vector<uint32_t>{0};
+		auto addNode = [&flat](SexpValueKind kind) {
+			flat.kinds.push_back(kind);
+			flat.sizes.push_back(1);
+			flat.offsets.push_back(uint32_t(flat.pool.size()));
+		};
+		addNode(SexpValueKind::SEXP); // root
+		auto scratch = std::string{};
+		for(;;) {
+			auto tok = lexer.next();
+			if(flat.kinds.size() == flat_max_nodes && (tok == TokenKind::OPEN || tok == TokenKind::SYMBOL || tok == TokenKind::STRING)) {
+				return flatTooBig(err);
+			}
+			switch(tok) {
+			case TokenKind::OPEN:
+				open.push_back(uint32_t(flat.kinds.size()));
+				addNode(SexpValueKind::SEXP);
+				break;
+			case TokenKind::CLOSE:
+				if(open.size() == 1) {
+					err = std::string{"too many ')' characters detected, closing sexprs that don't exist, no good."};
+					return FlatSexp{};
+				}
+				flat.sizes[open.back()] = uint32_t(flat.kinds.size() - open.back());
+				open.pop_back();
+				break;
+			case TokenKind::SYMBOL:
+				addNode(SexpValueKind::STRING);
+				scratch.assign(lexer.tokbegin, lexer.tokend);
+				if(countEscapeValues(scratch) != 0) scratch = escape(scratch);
+				flat.pool += scratch;
+				if(flat.pool.size() > flat_max_pool) return flatTooBig(err);
+				break;
+			case TokenKind::STRING:
+				addNode(SexpValueKind::STRING);
+				unescapeInto(scratch, lexer.tokbegin, lexer.tokend);
+				flat.pool += scratch;
+				if(flat.pool.size() > flat_max_pool) return flatTooBig(err);
+				break;
+			case TokenKind::ERROR:
+				err = std::move(lexer.err);
+				return FlatSexp{};
+			case TokenKind::END:
+				if(open.size() != 1) {
+					err = std::string{"not enough s-expressions were closed by the end of parsing"};
+					return FlatSexp{};
+				}
+				flat.sizes[0] = uint32_t(flat.kinds.size());
+				flat.offsets.push_back(uint32_t(flat.pool.size()));
+				return flat;
+			}
+		}
+	}
+
+	auto parseFlat(std::string const& str) -> FlatSexp {
+		auto ignored_error = std::string{};
+		return parseFlat(str, ignored_error);
+	}
+
+	// FlatSexp and SexpImage share these, they only differ in where the arrays live
+
+	template<typename Flat>
+	static auto flatChildCount(Flat const& flat, uint32_t node) -> size_t {
+		auto count = size_t{0};
+		for(auto i = node + 1; i != node + flat.sizes[node]; i += flat.sizes[i]) ++count;
+		return count;
+	}
+
+	// Follows the same rules as Sexp::getChildByPath
+	template<typename Flat>
+	static auto flatChildByPath(Flat const& flat, std::string const& path, uint32_t node) -> uint32_t {
+		auto paths = splitPathString(path);
+		if(flat.isString(node) || paths.empty()) return FlatSexp::npos;
+		auto cur = node;
+		for(auto i = paths.begin(); i != paths.end(); ++i) {
+			auto next = FlatSexp::npos;
+			for(auto child : flat.children(cur)) {
+				if(flat.isString(child)) {
+					if(i == paths.end() - 1 && flat.stringEquals(child, *i)) return child;
+					continue;
+				}
+				if(flat.sizes[child] == 1) continue;
+				if(flat.stringEquals(child + 1, *i)) {
+					next = child;
+					break;
+				}
+			}
+			if(next == FlatSexp::npos) return FlatSexp::npos;
+			cur = next;
+		}
+		return cur;
+	}
+
+	template<typename Flat>
+	static auto flatToSexp(Flat const& flat, uint32_t node) -> Sexp {
+		auto result = Sexp{};
+		if(flat.isString(node)) return Sexp::unescaped(flat.getString(node));
+		// Pre-order means every node's parent is the innermost open list before it.
+		// Lists reserve all their children up front, so the pointers stay valid.
+		result.value.sexp.reserve(flat.childCount(node));
+		auto open = std::vector<std::pair<Sexp*, uint32_t>>{};
+		open.emplace_back(&result, node + flat.sizes[node]);
+		for(auto i = node + 1; i != node + flat.sizes[node]; ++i) {
+			while(i == open.back().second) open.pop_back();
+			auto& parent = *open.back().first;
+			if(flat.isString(i)) {
+				parent.value.sexp.push_back(Sexp::unescaped(flat.getString(i)));
+			} else {
+				parent.value.sexp.emplace_back();
+				auto& list = parent.value.sexp.back();
+				list.value.sexp.reserve(flat.childCount(i));
+				open.emplace_back(&list, i + flat.sizes[i]);
+			}
+		}
+		return result;
+	}
+
+	auto FlatSexp::size() const -> size_t { return this->kinds.size(); }
+
+	auto FlatSexp::isString(uint32_t node) const -> bool { return this->kinds[node] == SexpValueKind::STRING; }
+
+	auto FlatSexp::isSexp(uint32_t node) const -> bool { return this->kinds[node] == SexpValueKind::SEXP; }
+
+	auto FlatSexp::childCount(uint32_t node) const -> size_t { return flatChildCount(*this, node); }
+
+	auto FlatSexp::children(uint32_t node) const -> FlatChildren {
+		return FlatChildren{FlatChildIterator{this->sizes.data(), node + 1}, FlatChildIterator{this->sizes.data(), node + this->sizes[node]}};
+	}
+
+	auto FlatSexp::getChild(uint32_t node, size_t idx) const -> uint32_t {
+		auto i = node + 1;
+		for(; idx != 0; --idx) i += this->sizes[i];
+		return i;
+	}
+
+	auto FlatSexp::stringData(uint32_t node) const -> char const* { return this->pool.data() + this->offsets[node]; }
+
+	auto FlatSexp::stringSize(uint32_t node) const -> size_t { return this->offsets[node + 1] - this->offsets[node]; }
+
+	auto FlatSexp::getString(uint32_t node) const -> std::string {
+		return std::string{this->stringData(node), this->stringSize(node)};
+	}
+
+	auto FlatSexp::stringEquals(uint32_t node, std::string const& str) const -> bool {
+		return this->isString(node) && this->stringSize(node) == str.size()
+			&& std::equal(str.begin(), str.end(), this->stringData(node));
+	}
+
+	auto FlatSexp::getChildByPath(std::string const& path, uint32_t node) const -> uint32_t {
+		return flatChildByPath(*this, path, node);
+	}
+
+	auto FlatSexp::toSexp(uint32_t node) const -> Sexp { return flatToSexp(*this, node); }
+
+	auto flatten(Sexp const& root, std::string& err) -> FlatSexp {
+		auto nodes = size_t{0};
+		auto bytes = size_t{0};
+		visitNodes(root, [&nodes, &bytes](Sexp const& node) {
+			++nodes;
+			if(node.kind == SexpValueKind::STRING) bytes += node.value.str.size();
+		});
+		if(nodes > flat_max_nodes || bytes > flat_max_pool) return flatTooBig(err);
+		auto flat = FlatSexp{};
+		flat.kinds.reserve(nodes);
+		flat.sizes.reserve(nodes);
+		flat.offsets.reserve(nodes + 1);
+		flat.pool.reserve(bytes);
+		// Lists still waiting for some of their children, a list's size is known once
+		// its last child is done
+		struct Open {
+			uint32_t node;
+			size_t left;
+		};
+		auto open = std::vector<Open>{};
+		visitNodes(root, [&flat, &open](Sexp const& node) {
+			auto id = uint32_t(flat.kinds.size());
+			flat.kinds.push_back(node.kind);
+			flat.sizes.push_back(1);
+			flat.offsets.push_back(uint32_t(flat.pool.size()));
+			if(node.kind == SexpValueKind::STRING) flat.pool += node.value.str;
+			else if(!node.value.sexp.empty()) {
+				open.push_back(Open{id, node.value.sexp.size()});
+				return;
+			}
+			while(!open.empty() && --open.back().left == 0) {
+				flat.sizes[open.back().node] = uint32_t(flat.kinds.size() - open.back().node);
+				open.pop_back();
+			}
+		});
+		flat.offsets.push_back(uint32_t(flat.pool.size()));
+		return flat;
+	}
+
+	auto flatten(Sexp const& root) -> FlatSexp {
+		auto ignored_error = std::string{};
+		return flatten(root, ignored_error);
+	}
+
+	auto FlatChildIterator::operator*() const -> uint32_t { return this->node; }
+
+	auto FlatChildIterator::operator++() -> FlatChildIterator& {
+		this->node += this->sizes[this->node];
+		return *this;
+	}
+
+	auto FlatChildIterator::operator!=(FlatChildIterator const& other) const -> bool { return this->node != other.node; }
+
+	auto FlatChildren::begin() const -> FlatChildIterator { return this->first; }
+
+	auto FlatChildren::end() const -> FlatChildIterator { return this->last; }
+
+	// Starts every image. Read on a machine with the other byte order it doesn't match.
+	static constexpr uint32_t imageMagic = 0x69707873; // "sxpi"
+	static constexpr uint32_t imageVersion = 1;
+
+	// Followed by the sections, each starting at a multiple of 8 bytes from the
+	// beginning of the image: sizes and offsets as in FlatSexp, then one byte per
+	// node for the kinds, then the string pool. A FlatSexp's arrays together can pass
+	// 4 GiB, so the sections are placed with 64 bit offsets.
+	struct SexpImageHeader {
+		uint32_t magic;
+		uint32_t version;
+		uint32_t nodes;
+		uint32_t poolsize;
+		uint64_t sizes; // where each section starts
+		uint64_t offsets;
+		uint64_t kinds;
+		uint64_t pool;
+	};
+
+	static auto alignImage(size_t offset) -> size_t { return (offset + 7) & ~size_t{7}; }
+
+	auto toImage(FlatSexp const& flat) -> std::string {
+		auto nodes = flat.size();
+		auto header = SexpImageHeader{imageMagic, imageVersion, uint32_t(nodes), uint32_t(flat.pool.size()), 0, 0, 0, 0};
+		header.sizes = alignImage(sizeof header);
+		header.offsets = alignImage(header.sizes + nodes * sizeof(uint32_t));
+		header.kinds = alignImage(header.offsets + (nodes + 1) * sizeof(uint32_t));
+		header.pool = alignImage(header.kinds + nodes);
+		auto image = std::string(header.pool + flat.pool.size(), '\0');
+		std::memcpy(&image[0], &header, sizeof header);
+		std::memcpy(&image[header.sizes], flat.sizes.data(), nodes * sizeof(uint32_t));
+		std::memcpy(&image[header.offsets], flat.offsets.data(), flat.offsets.size() * sizeof(uint32_t));
+		std::memcpy(&image[header.kinds], flat.kinds.data(), nodes);
+		std::memcpy(&image[header.pool], flat.pool.data(), flat.pool.size());
+		return image;
+	}
+
+	auto viewImage(char const* data, size_t size, std::string& err) -> SexpImage {
+		auto header = SexpImageHeader{};
+		if(reinterpret_cast<uintptr_t>(data) % 8 != 0) {
+			err = std::string{"the image has to be aligned to 8 bytes"};
+			return SexpImage{};
+		}
+		if(size < sizeof header) {
+			err = std::string{"too small to be an image"};
+			return SexpImage{};
+		}
+		std::memcpy(&header, data, sizeof header);
+		if(header.magic != imageMagic) {
+			err = std::string{"not an image, or written on a machine with a different byte order"};
+			return SexpImage{};
+		}
+		if(header.version != imageVersion) {
+			err = std::string{"unsupported image version "} + std::to_string(header.version);
+			return SexpImage{};
+		}
+		auto nodes = size_t{header.nodes};
+		auto fits = [size](uint64_t begin, size_t bytes) { return begin % 8 == 0 && begin <= size && bytes <= size - begin; };
+		if(nodes == 0 || !fits(header.sizes, nodes * sizeof(uint32_t)) || !fits(header.offsets, (nodes + 1) * sizeof(uint32_t))
+		   || !fits(header.kinds, nodes) || !fits(header.pool, header.poolsize)) {
+			err = std::string{"the image is truncated or corrupt"};
+			return SexpImage{};
+		}
+		auto image = SexpImage{};
+		image.nodes = header.nodes;
+		image.kinds = reinterpret_cast<SexpValueKind const*>(data + header.kinds);
+		image.sizes = reinterpret_cast<uint32_t const*>(data + header.sizes);
+		image.offsets = reinterpret_cast<uint32_t const*>(data + header.offsets);
+		image.pool = data + header.pool;
+		if(image.sizes[0] != nodes || image.offsets[nodes] != header.poolsize) {
+			err = std::string{"the image is truncated or corrupt"};
+			return SexpImage{};
+		}
+		return image;
+	}
+
+	auto SexpImage::size() const -> size_t { return this->nodes; }
+
+	auto SexpImage::isString(uint32_t node) const -> bool { return this->kinds[node] == SexpValueKind::STRING; }
+
+	auto SexpImage::isSexp(uint32_t node) const -> bool { return this->kinds[node] == SexpValueKind::SEXP; }
+
+	auto SexpImage::childCount(uint32_t node) const -> size_t { return flatChildCount(*this, node); }
+
+	auto SexpImage::children(uint32_t node) const -> FlatChildren {
+		return FlatChildren{FlatChildIterator{this->sizes, node + 1}, FlatChildIterator{this->sizes, node + this->sizes[node]}};
+	}
+
+	auto SexpImage::arguments(uint32_t node) const -> FlatChildren {
+		auto first = node + 1;
+		auto last = node + this->sizes[node];
+		if(first != last) first += this->sizes[first];
+		return FlatChildren{FlatChildIterator{this->sizes, first}, FlatChildIterator{this->sizes, last}};
+	}
+
+	auto SexpImage::getChild(uint32_t node, size_t idx) const -> uint32_t {
+		auto i = node + 1;
+		for(; idx != 0; --idx) i += this->sizes[i];
+		return i;
+	}
+
+	auto SexpImage::stringData(uint32_t node) const -> char const* { return this->pool + this->offsets[node]; }
+
+	auto SexpImage::stringSize(uint32_t node) const -> size_t { return this->offsets[node + 1] - this->offsets[node]; }
+
+	auto SexpImage::getString(uint32_t node) const -> std::string {
+		return std::string{this->stringData(node), this->stringSize(node)};
+	}
+
+	auto SexpImage::stringEquals(uint32_t node, std::string const& str) const -> bool {
+		return this->isString(node) && this->stringSize(node) == str.size()
+			&& std::equal(str.begin(), str.end(), this->stringData(node));
+	}
+
+	auto SexpImage::getChildByPath(std::string const& path, uint32_t node) const -> uint32_t {
+		return flatChildByPath(*this, path, node);
+	}
+
+	// Same output as Sexp::toString. Pre-order again, a list is closed when the walk
+	// reaches the node after its subtree.
+	auto SexpImage::toString(uint32_t node) const -> std::string {
+		auto out = std::string{};
+		if(this->isString(node)) {
+			appendStringVal(out, this->stringData(node), this->stringData(node) + this->stringSize(node));
+			return out;
+		}
+		auto ends = std::vector<uint32_t>{};
+		auto first = true; // nothing printed yet in the innermost open list
+		for(auto i = node + 1; i != node + this->sizes[node]; ++i) {
+			while(!ends.empty() && ends.back() == i) {
+				out.push_back(')');
+				ends.pop_back();
+				first = false;
+			}
+			if(!first) out.push_back(' ');
+			first = false;
+			if(this->isString(i)) {
+				appendStringVal(out, this->stringData(i), this->stringData(i) + this->stringSize(i));
+			} else if(this->sizes[i] == 1) {
+				out += "()";
+			} else {
+				out.push_back('(');
+				ends.push_back(i + this->sizes[i]);
+				first = true;
+			}
+		}
+		out.append(ends.size(), ')');
+		return out;
+	}
+
+	auto SexpImage::toSexp(uint32_t node) const -> Sexp { return flatToSexp(*this, node); }
+
+	auto compileQuery(std::string const& query, std::string& err) -> SexpQuery {
+		auto compiled = SexpQuery{};
+		for(auto& segment : splitPathString(query)) {
+			auto bracket = segment.find('[');
+			auto step = SexpQueryStep{SexpQueryStep::Kind::NAME, segment.substr(0, bracket), std::string::npos, {}};
+			if(step.name == "**") step.kind = SexpQueryStep::Kind::DESCENDANTS;
+			else if(step.name == "*") step.kind = SexpQueryStep::Kind::ANY;
+			else if(step.name.empty()) {
+				err = std::string{"empty step in query"};
+				return SexpQuery{};
+			}
+			while(bracket != std::string::npos) {
+				if(segment[bracket] != '[') {
+					err = std::string{"unexpected '"} + segment[bracket] + "' after ']' in query";
+					return SexpQuery{};
+				}
+				auto close = segment.find(']', bracket);
+				if(close == std::string::npos) {
+					err = std::string{"unclosed '[' in query"};
+					return SexpQuery{};
+				}
+				auto filter = segment.substr(bracket + 1, close - bracket - 1);
+				if(filter.empty() || step.kind == SexpQueryStep::Kind::DESCENDANTS) {
+					err = std::string{"invalid filter '["} + filter + "]' in query";
+					return SexpQuery{};
+				}
+				if(std::all_of(filter.begin(), filter.end(), [](char c) { return c >= '0' && c <= '9'; })) {
+					step.position = std::strtoul(filter.c_str(), nullptr, 10);
+				} else {
+					auto eq = filter.find('=');
+					auto hasvalue = eq != std::string::npos;
+					step.predicates.push_back(SexpQueryPredicate{filter.substr(0, eq), hasvalue ? filter.substr(eq + 1) : std::string{}, hasvalue});
+				}
+				bracket = close + 1 == segment.size() ? std::string::npos : close + 1;
+			}
+			compiled.steps.push_back(std::move(step));
+		}
+		if(compiled.steps.size() > 63) {
+			err = std::string{"too many steps in query"};
+			return SexpQuery{};
+		}
+		return compiled;
+	}
+
+	static auto queryBit(size_t step) -> uint64_t { return uint64_t{1} << step; }
+
+	// Adds the states reachable without consuming a node: '**' may match no levels
+	static auto queryClosure(std::vector<SexpQueryStep> const& steps, uint64_t states) -> uint64_t {
+		for(auto k = size_t{0}; k < steps.size(); ++k) {
+			if((states & queryBit(k)) && steps[k].kind == SexpQueryStep::Kind::DESCENDANTS) states |= queryBit(k + 1);
+		}
+		return states;
+	}
+
+	static auto passesPredicates(SexpQueryStep const& step, Sexp const& node) -> bool {
+		for(auto& pred : step.predicates) {
+			if(!node.isSexp()) return false;
+			auto found = std::find_if(node.value.sexp.begin(), node.value.sexp.end(), [&pred](Sexp const& c) {
+				auto hd = headName(c);
+				return c.isSexp() && hd != nullptr && *hd == pred.key;
+			});
+			if(found == node.value.sexp.end()) return false;
+			if(!pred.hasvalue) continue;
+			auto& args = found->value.sexp;
+			if(args.size() < 2 || !args[1].isString() || args[1].value.str != pred.value) return false;
+		}
+		return true;
+	}
+
+	static auto stepMatches(SexpQueryStep const& step, Sexp const& node, bool last) -> bool {
+		switch(step.kind) {
+		case SexpQueryStep::Kind::ANY:
+			if(!node.isSexp()) return false;
+			break;
+		case SexpQueryStep::Kind::NAME: {
+			if(node.isString() && !last) return false;
+			auto hd = headName(node);
+			if(hd == nullptr || *hd != step.name) return false;
+			break;
+		}
+		case SexpQueryStep::Kind::DESCENDANTS:
+			return false;
+		}
+		return passesPredicates(step, node);
+	}
+
+	// Runs the query as a state machine over a single pre-order walk. The states of a
+	// node are the steps that its children could match next, as a bit set.
+	auto SexpQuery::select(Sexp& root) const -> std::vector<Sexp*> {
+		auto& steps = this->steps;
+		auto matches = std::vector<Sexp*>{};
+		auto accept = queryBit(steps.size());
+		auto counts = std::vector<size_t>(steps.size());
+		auto pending = std::vector<std::pair<Sexp*, uint64_t>>{};
+		pending.emplace_back(&root, queryClosure(steps, queryBit(0)));
+		while(!pending.empty()) {
+			auto node = pending.back().first;
+			auto states = pending.back().second;
+			pending.pop_back();
+			if(states & accept) matches.push_back(node);
+			if(!node->isSexp()) continue;
+			std::fill(counts.begin(), counts.end(), 0);
+			auto first = pending.size();
+			for(auto& child : node->value.sexp) {
+				auto next = uint64_t{0};
+				auto ishead = &child == &node->value.sexp.front() && child.isString();
+				for(auto k = size_t{0}; k < steps.size() && !ishead; ++k) {
+					if(!(states & queryBit(k))) continue;
+					if(steps[k].kind == SexpQueryStep::Kind::DESCENDANTS) {
+						if(child.isSexp()) next |= queryBit(k);
+						continue;
+					}
+					if(!stepMatches(steps[k], child, k + 1 == steps.size())) continue;
+					if(steps[k].position != std::string::npos && counts[k]++ != steps[k].position) continue;
+					next |= queryBit(k + 1);
+				}
+				next = queryClosure(steps, next);
+				if(next != 0) pending.emplace_back(&child, next);
+			}
+			std::reverse(pending.begin() + first, pending.end()); // so children pop in order
+		}
+		return matches;
+	}
+
+	// Whether the atom the lexer is on would hold str once parsed
+	static auto tokenEquals(Lexer const& lexer, TokenKind tok, std::string const& str, std::string& scratch) -> bool {
+		if(tok == TokenKind::STRING) {
+			unescapeInto(scratch, lexer.tokbegin, lexer.tokend);
+		} else if(tok == TokenKind::SYMBOL) {
+			scratch.assign(lexer.tokbegin, lexer.tokend);
+			if(countEscapeValues(scratch) != 0) scratch = escape(scratch);
+		} else {
+			return false;
+		}
+		return scratch == str;
+	}
+
+	// Checks a step's filters against the children of the list the lexer has just
+	// opened, reading ahead on a copy of the lexer.
+	static auto lookaheadPredicates(SexpQueryStep const& step, Lexer const& lexer, std::string& scratch) -> bool {
+		for(auto& pred : step.predicates) {
+			auto ahead = lexer;
+			for(auto found = false; !found;) {
+				auto tok = ahead.next();
+				if(tok == TokenKind::CLOSE || tok == TokenKind::END || tok == TokenKind::ERROR) return false;
+				if(tok != TokenKind::OPEN) continue;
+				auto head = ahead.next();
+				if(head == TokenKind::CLOSE) continue;
+				if(head == TokenKind::OPEN) {
+					if(!ahead.skipList() || !ahead.skipList()) return false;
+					continue;
+				}
+				if(!tokenEquals(ahead, head, pred.key, scratch)) {
+					if(!ahead.skipList()) return false;
+					continue;
+				}
+				if(pred.hasvalue && !tokenEquals(ahead, ahead.next(), pred.value, scratch)) return false;
+				found = true;
+			}
+		}
+		return true;
+	}
+
+	SexpQueryScanner::SexpQueryScanner(SexpQuery query, char const* begin, char const* end)
+		: SexpQueryScanner(std::vector<SexpQuery>{std::move(query)}, begin, end) {}
+
+	SexpQueryScanner::SexpQueryScanner(SexpQuery query, std::string const& str) : SexpQueryScanner(std::move(query), str.data(), str.data() + str.size()) {}
+
+	// The queries' steps go one after another, so the states of all of them fit in one
+	// bit set and advance together
+	SexpQueryScanner::SexpQueryScanner(std::vector<SexpQuery> queries, char const* begin, char const* end)
+		: queries(std::move(queries)), lexer(begin, end) {
+		auto states = uint64_t{0};
+		for(auto& query : this->queries) {
+			if(this->steps.size() + query.steps.size() + 1 > 64) {
+				this->fail("too many steps in the queries together");
+				return;
+			}
+			states |= queryBit(this->steps.size());
+			this->steps.insert(this->steps.end(), query.steps.begin(), query.steps.end());
+			this->accept |= queryBit(this->steps.size());
+			this->steps.push_back(SexpQueryStep{SexpQueryStep::Kind::NAME, std::string{}, std::string::npos, {}});
+		}
+		states = queryClosure(this->steps, states);
+		this->frames.push_back(Frame{states, 0, (states & this->accept) ? begin : nullptr});
+		this->counts.resize(this->steps.size());
+	}
+
+	SexpQueryScanner::SexpQueryScanner(std::vector<SexpQuery> queries, std::string const& str)
+		: SexpQueryScanner(std::move(queries), str.data(), str.data() + str.size()) {}
+
+	auto SexpQueryScanner::next() -> Sexp* {
+		auto& steps = this->steps;
+		auto accept = this->accept;
+		while(!this->frames.empty()) {
+			auto tok = this->lexer.next();
+			switch(tok) {
+			case TokenKind::ERROR:
+				return this->fail(std::move(this->lexer.err));
+			case TokenKind::END: {
+				if(this->frames.size() != 1) return this->fail("not enough s-expressions were closed by the end of parsing");
+				auto frame = this->frames.back();
+				this->frames.clear();
+				if(frame.start != nullptr) return this->deliver(frame.start, frame.states, true);
+				break;
+			}
+			case TokenKind::CLOSE: {
+				if(this->frames.size() == 1) return this->fail("too many ')' characters detected, closing sexprs that don't exist, no good.");
+				auto frame = this->frames.back();
+				this->frames.pop_back();
+				this->counts.resize(this->frames.size() * steps.size());
+				if(frame.start != nullptr) return this->deliver(frame.start, frame.states, false);
+				break;
+			}
+			default: {
+				auto start = tok == TokenKind::STRING ? this->lexer.tokbegin - 1 : this->lexer.tokbegin;
+				auto& frame = this->frames.back();
+				auto ishead = frame.child++ == 0 && tok != TokenKind::OPEN;
+				auto states = ishead ? uint64_t{0} : this->advance(tok, frame.states);
+				if(tok != TokenKind::OPEN) {
+					if(states & accept) return this->deliver(start, states, false);
+				} else if(states == 0) {
+					if(!this->lexer.skipList()) return this->fail(std::move(this->lexer.err));
+				} else {
+					this->frames.push_back(Frame{states, 0, (states & accept) ? start : nullptr});
+					this->counts.resize(this->frames.size() * steps.size(), 0);
+				}
+				break;
+			}
+			}
+		}
+		return nullptr;
+	}
+
+	// Works out the states of the node the lexer is on from those of its parent, the
+	// same way SexpQuery::select does
+	auto SexpQueryScanner::advance(TokenKind tok, uint64_t states) -> uint64_t {
+		auto& steps = this->steps;
+		auto counts = this->counts.data() + (this->frames.size() - 1) * steps.size();
+		auto next = uint64_t{0};
+		states &= ~this->accept; // nothing goes on from a finished query
+		for(auto k = size_t{0}; k < steps.size(); ++k) {
+			if(!(states & queryBit(k))) continue;
+			if(steps[k].kind == SexpQueryStep::Kind::DESCENDANTS) {
+				if(tok == TokenKind::OPEN) next |= queryBit(k);
+				continue;
+			}
+			if(!this->matches(steps[k], tok, (this->accept & queryBit(k + 1)) != 0)) continue;
+			if(steps[k].position != std::string::npos && counts[k]++ != steps[k].position) continue;
+			next |= queryBit(k + 1);
+		}
+		return queryClosure(steps, next);
+	}
+
+	auto SexpQueryScanner::matches(SexpQueryStep const& step, TokenKind tok, bool last) -> bool {
+		switch(step.kind) {
+		case SexpQueryStep::Kind::ANY:
+			if(tok != TokenKind::OPEN) return false;
+			break;
+		case SexpQueryStep::Kind::NAME:
+			if(tok != TokenKind::OPEN) return last && step.predicates.empty() && tokenEquals(this->lexer, tok, step.name, this->scratch);
+			else {
+				auto ahead = this->lexer;
+				if(!tokenEquals(ahead, ahead.next(), step.name, this->scratch)) return false;
+			}
+			break;
+		case SexpQueryStep::Kind::DESCENDANTS:
+			return false;
+		}
+		return step.predicates.empty() || lookaheadPredicates(step, this->lexer, this->scratch);
+	}
+
+	// Builds the match that started at start and ends where the lexer is now
+	auto SexpQueryScanner::deliver(char const* start, uint64_t states, bool root) -> Sexp* {
+		this->matched.clear();
+		auto query = size_t{0};
+		for(auto k = size_t{0}; k < this->steps.size(); ++k) {
+			if(!(this->accept & queryBit(k))) continue;
+			if(states & queryBit(k)) this->matched.push_back(query);
+			++query;
+		}
+		this->parser.parseInto(this->holder, start, this->lexer.cur, this->err);
+		return root ? &this->holder : &this->holder.value.sexp[0];
+	}
+
+	auto SexpQueryScanner::fail(std::string msg) -> Sexp* {
+		this->err = std::move(msg);
+		this->frames.clear();
+		return nullptr;
+	}
+
+	auto compilePattern(std::string const& pattern, std::string& err) -> SexpPattern {
+		auto parseerr = std::string{};
+		auto tree = parse(pattern, parseerr);
+		if(!parseerr.empty()) {
+			err = std::move(parseerr);
+			return SexpPattern{};
+		}
+		if(tree.childCount() != 1) {
+			err = std::string{"a pattern has to be exactly one s-expression"};
+			return SexpPattern{};
+		}
+		using Kind = SexpPattern::Node::Kind;
+		auto compiled = SexpPattern{};
+		auto& nodes = compiled.nodes;
+		auto parents = std::vector<size_t>{};
+		auto pending = std::vector<std::pair<Sexp const*, size_t>>{{&tree.value.sexp[0], std::string::npos}};
+		while(!pending.empty()) {
+			auto sexp = pending.back().first;
+			auto parent = pending.back().second;
+			pending.pop_back();
+			auto node = SexpPattern::Node{Kind::ATOM, {}, 1, 0, std::string::npos, 0};
+			if(sexp->isSexp()) {
+				node.kind = Kind::LIST;
+				node.count = sexp->value.sexp.size();
+				for(auto it = sexp->value.sexp.rbegin(); it != sexp->value.sexp.rend(); ++it) pending.emplace_back(&*it, nodes.size());
+			} else if(sexp->value.str.size() > 2 && sexp->value.str.compare(0, 2, "\\?") == 0) {
+				// symbols are stored escaped, so this is a ?name symbol and not a "?name" string
+				auto& str = sexp->value.str;
+				auto dots = str.size() > 5 && str.compare(str.size() - 3, 3, "...") == 0;
+				node.kind = dots ? Kind::SPLICE : Kind::CAPTURE;
+				node.text = str.substr(2, str.size() - (dots ? 5 : 2));
+				if(std::find(compiled.names.begin(), compiled.names.end(), node.text) != compiled.names.end()) {
+					err = std::string{"capture '?"} + node.text + "' is used more than once";
+					return SexpPattern{};
+				}
+				node.slot = compiled.names.size();
+				compiled.names.push_back(node.text);
+				if(dots) {
+					if(parent == std::string::npos || nodes[parent].splice != std::string::npos) {
+						err = std::string{"'"} + str + "' has to be inside a list, and only one per list";
+						return SexpPattern{};
+					}
+					nodes[parent].splice = nodes.size() - parent - 1;
+				}
+			} else {
+				node.text = sexp->value.str;
+			}
+			parents.push_back(parent);
+			nodes.push_back(std::move(node));
+		}
+		for(auto i = nodes.size(); i-- > 1;) nodes[parents[i]].size += nodes[i].size;
+		// splice held the splice's node offset from its list until here, make it a child index
+		for(auto i = size_t{0}; i < nodes.size(); ++i) {
+			if(nodes[i].splice == std::string::npos) continue;
+			auto child = i + 1;
+			auto idx = size_t{0};
+			for(; child - i - 1 != nodes[i].splice; child += nodes[child].size) ++idx;
+			nodes[i].splice = idx;
+		}
+		return compiled;
+	}
+
+	static auto matchPattern(std::vector<SexpPattern::Node> const& nodes, size_t idx, Sexp const& sexp, std::vector<SexpCapture>& captures) -> bool {
+		auto& node = nodes[idx];
+		switch(node.kind) {
+		case SexpPattern::Node::Kind::ATOM:
+			return sexp.isString() && sexp.value.str == node.text;
+		case SexpPattern::Node::Kind::CAPTURE:
+			captures[node.slot] = SexpCapture{&sexp, &sexp + 1};
+			return true;
+		case SexpPattern::Node::Kind::SPLICE:
+			break;
+		case SexpPattern::Node::Kind::LIST: {
+			if(!sexp.isSexp()) return false;
+			auto& children = sexp.value.sexp;
+			auto fixed = node.splice == std::string::npos ? node.count : node.count - 1;
+			if(node.splice == std::string::npos ? children.size() != fixed : children.size() < fixed) return false;
+			auto child = idx + 1;
+			for(auto i = size_t{0}; i < node.count; child += nodes[child].size, ++i) {
+				if(i == node.splice) {
+					auto first = children.data() + i;
+					captures[nodes[child].slot] = SexpCapture{first, first + (children.size() - fixed)};
+				} else if(!matchPattern(nodes, child, i < node.splice ? children[i] : children[children.size() - (node.count - i)], captures)) {
+					return false;
+				}
+			}
+			return true;
+		}
+		}
+		printShouldNeverReachHere();
+		return false;
+	}
+
+	auto SexpPattern::match(Sexp const& sexp, std::vector<SexpCapture>& captures) const -> bool {
+		if(this->nodes.empty()) return false;
+		captures.resize(this->names.size());
+		return matchPattern(this->nodes, 0, sexp, captures);
+	}
+
+	auto SexpPattern::slot(std::string const& name) const -> size_t {
+		auto it = std::find(this->names.begin(), this->names.end(), name);
+		return it == this->names.end() ? std::string::npos : it - this->names.begin();
+	}
+
+	static auto bucketBefore(SexpDispatcher::Bucket const& bucket, std::pair<std::string const*, size_t> const& key) -> bool {
+		auto cmp = bucket.head.compare(*key.first);
+		return cmp < 0 || (cmp == 0 && bucket.length < key.second);
+	}
+
+	static auto findBucket(std::vector<SexpDispatcher::Bucket> const& buckets, std::string const& head, size_t length) -> std::vector<size_t> const* {
+		auto key = std::make_pair(&head, length);
+		auto it = std::lower_bound(buckets.begin(), buckets.end(), key, bucketBefore);
+		if(it == buckets.end() || it->head != head || it->length != length) return nullptr;
+		return &it->ids;
+	}
+
+	auto SexpDispatcher::add(SexpPattern pattern) -> size_t {
+		auto id = this->patterns.size();
+		this->patterns.push_back(std::move(pattern));
+		auto& nodes = this->patterns.back().nodes;
+		if(nodes.empty() || nodes[0].kind != SexpPattern::Node::Kind::LIST || nodes[0].count == 0 || nodes[0].splice == 0 || nodes[1].kind != SexpPattern::Node::Kind::ATOM) {
+			this->unindexed.push_back(id);
+			return id;
+		}
+		auto length = nodes[0].splice == std::string::npos ? nodes[0].count : std::string::npos;
+		auto key = std::make_pair(&nodes[1].text, length);
+		auto it = std::lower_bound(this->buckets.begin(), this->buckets.end(), key, bucketBefore);
+		if(it == this->buckets.end() || it->head != nodes[1].text || it->length != length) {
+			it = this->buckets.insert(it, Bucket{nodes[1].text, length, {}});
+		}
+		it->ids.push_back(id);
+		return id;
+	}
+
+	auto SexpDispatcher::match(Sexp const& sexp, std::vector<SexpCapture>& captures) const -> size_t {
+		// Tries the candidates from the exact bucket, the splice bucket and the unindexed
+		// patterns in the order they were added
+		auto lists = std::array<std::vector<size_t> const*, 3>{{nullptr, nullptr, &this->unindexed}};
+		if(sexp.isSexp() && !sexp.value.sexp.empty() && sexp.value.sexp[0].isString()) {
+			auto& head = sexp.value.sexp[0].value.str;
+			lists[0] = findBucket(this->buckets, head, sexp.value.sexp.size());
+			lists[1] = findBucket(this->buckets, head, std::string::npos);
+		}
+		auto pos = std::array<size_t, 3>{{0, 0, 0}};
+		for(;;) {
+			auto best = lists.size();
+			for(auto l = size_t{0}; l < lists.size(); ++l) {
+				if(lists[l] == nullptr || pos[l] == lists[l]->size()) continue;
+				if(best == lists.size() || (*lists[l])[pos[l]] < (*lists[best])[pos[best]]) best = l;
+			}
+			if(best == lists.size()) return std::string::npos;
+			auto id = (*lists[best])[pos[best]++];
+			if(this->patterns[id].match(sexp, captures)) return id;
+		}
+	}
+
+	auto spliceChild(Sexp& list, size_t idx) -> size_t {
+		auto& children = list.value.sexp;
+		if(!children[idx].isSexp()) return 1;
+		auto grandchildren = std::move(children[idx].value.sexp);
+		if(grandchildren.empty()) {
+			children.erase(children.begin() + idx);
+			return 0;
+		}
+		list.sorted = false;
+		children[idx] = std::move(grandchildren[0]);
+		children.insert(children.begin() + idx + 1, std::make_move_iterator(grandchildren.begin() + 1), std::make_move_iterator(grandchildren.end()));
+		return grandchildren.size();
+	}
+
+	auto parallelWorkers(size_t count, unsigned threads) -> unsigned {
+		if(threads == 0) threads = std::max(1u, std::thread::hardware_concurrency());
+		if(threads > count) threads = unsigned(count);
+		return std::max(1u, threads);
+	}
+
+	auto parallelFor(size_t count, void (*body)(void* context, unsigned worker, size_t i), void* context, unsigned threads) -> void {
+		auto workers = parallelWorkers(count, threads);
+		if(workers == 1) {
+			for(auto i = size_t{0}; i < count; ++i) body(context, 0, i);
+			return;
+		}
+		struct Share {
+			std::mutex lock;
+			size_t begin;
+			size_t end;
+		};
+		auto shares = std::vector<Share>(workers);
+		for(auto w = size_t{0}; w < workers; ++w) {
+			shares[w].begin = count * w / workers;
+			shares[w].end = count * (w + 1) / workers;
+		}
+		auto work = [&](unsigned worker) {
+			auto& own = shares[worker];
+			for(;;) {
+				auto i = size_t{0};
+				{
+					std::lock_guard<std::mutex> guard{own.lock};
+					i = own.begin < own.end ? own.begin++ : std::string::npos;
+				}
+				if(i != std::string::npos) {
+					body(context, worker, i);
+					continue;
+				}
+				// Out of work, steal the back half of the biggest share
+				auto victim = workers;
+				auto most = size_t{0};
+				for(auto w = 0u; w < workers; ++w) {
+					std::lock_guard<std::mutex> guard{shares[w].lock};
+					if(shares[w].end - shares[w].begin > most) {
+						most = shares[w].end - shares[w].begin;
+						victim = w;
+					}
+				}
+				if(victim == workers) return;
+				auto first = size_t{0};
+				auto last = size_t{0};
+				{
+					std::lock_guard<std::mutex> guard{shares[victim].lock};
+					auto& share = shares[victim];
+					last = share.end;
+					first = share.end - (share.end - share.begin + 1) / 2;
+					share.end = first;
+				}
+				std::lock_guard<std::mutex> guard{own.lock};
+				own.begin = first;
+				own.end = last;
+			}
+		};
+		auto threadpool = std::vector<std::thread>{};
+		for(auto w = 1u; w < workers; ++w) threadpool.emplace_back(work, w);
+		work(0);
+		for(auto& t : threadpool) t.join();
+	}
+
+	auto splitSubtrees(Sexp const& root, size_t want, void (*above)(void* context, Sexp const& node), void* context, std::vector<Sexp const*>& subtrees) -> void {
+		subtrees.assign(1, &root);
+		auto next = std::vector<Sexp const*>{};
+		while(subtrees.size() < want) {
+			next.clear();
+			auto split = false;
+			for(auto node : subtrees) {
+				if(!node->isSexp() || node->value.sexp.empty()) {
+					next.push_back(node);
+					continue;
+				}
+				above(context, *node);
+				for(auto& child : node->value.sexp) next.push_back(&child);
+				split = true;
+			}
+			subtrees.swap(next);
+			if(!split) break;
+		}
+	}
+
+	auto parseInto(Sexp& target, std::string const& str, std::string& err) -> void {
+		auto parser = Parser{};
+		parser.parseInto(target, str, err);
+	}
+
+	auto parseInto(Sexp& target, std::string const& str) -> void {
+		auto ignored_error = std::string{};
+		parseInto(target, str, ignored_error);
+	}
+
+	auto unexpectedToken(Lexer& lexer, TokenKind tok) -> bool {
+		switch(tok) {
+		case TokenKind::ERROR:
+			break;
+		case TokenKind::END:
+			lexer.fail(lexer.cur, "unexpected end of input");
+			break;
+		default:
+			lexer.fail(lexer.tokbegin, "unexpected '" + std::string{lexer.tokbegin, lexer.tokend} + '\'');
+		}
+		return false;
+	}
+
+	auto expectHead(Lexer& lexer, char const* head) -> bool {
+		auto tok = lexer.next();
+		if(tok != TokenKind::OPEN) return unexpectedToken(lexer, tok);
+		tok = lexer.next();
+		if(tok != TokenKind::SYMBOL) return unexpectedToken(lexer, tok);
+		if(!lexer.tokenIs(head)) {
+			lexer.fail(lexer.tokbegin, std::string{"expected '"} + head + "' but got '" + std::string{lexer.tokbegin, lexer.tokend} + '\'');
+			return false;
+		}
+		return true;
+	}
+
+	auto expectClose(Lexer& lexer) -> bool {
+		auto tok = lexer.next();
+		return tok == TokenKind::CLOSE || unexpectedToken(lexer, tok);
+	}
+
+	// The text of the next atom, unescaped if it's a string literal
+	static auto atomText(Lexer& lexer, std::string& out) -> bool {
+		auto tok = lexer.next();
+		switch(tok) {
+		case TokenKind::SYMBOL:
+			out.assign(lexer.tokbegin, lexer.tokend);
+			return true;
+		case TokenKind::STRING:
+			unescapeInto(out, lexer.tokbegin, lexer.tokend);
+			return true;
+		default:
+			return unexpectedToken(lexer, tok);
+		}
+	}
+
+	static auto notANumber(Lexer& lexer, std::string const& text) -> bool {
+		lexer.fail(lexer.tokbegin, "'" + text + "' is not a valid number");
+		return false;
+	}
+
+	template<typename T>
+	static auto deserializeSigned(Lexer& lexer, T& out) -> bool {
+		auto text = std::string{};
+		if(!atomText(lexer, text)) return false;
+		auto end = static_cast<char*>(nullptr);
+		errno = 0;
+		auto val = std::strtoll(text.c_str(), &end, 10);
+		if(text.empty() || *end != '\0' || errno == ERANGE) return notANumber(lexer, text);
+		if(val < std::numeric_limits<T>::min() || val > std::numeric_limits<T>::max()) return notANumber(lexer, text);
+		out = static_cast<T>(val);
+		return true;
+	}
+
+	template<typename T>
+	static auto deserializeUnsigned(Lexer& lexer, T& out) -> bool {
+		auto text = std::string{};
+		if(!atomText(lexer, text)) return false;
+		auto end = static_cast<char*>(nullptr);
+		errno = 0;
+		auto val = std::strtoull(text.c_str(), &end, 10);
+		if(text.empty() || text[0] == '-' || *end != '\0' || errno == ERANGE) return notANumber(lexer, text);
+		if(val > std::numeric_limits<T>::max()) return notANumber(lexer, text);
+		out = static_cast<T>(val);
+		return true;
+	}
+
+	// Reads all of text as a number the way the "C" locale would, whatever the current
+	// one is. Streams don't read infinities and NaN, so those are matched here.
+	static auto readDouble(std::string const& text, double& out) -> bool {
+		if(text == "inf" || text == "+inf" || text == "-inf") {
+			out = text[0] == '-' ? -std::numeric_limits<double>::infinity() : std::numeric_limits<double>::infinity();
+			return true;
+		}
+		if(text == "nan" || text == "+nan" || text == "-nan") {
+			out = text[0] == '-' ? -std::numeric_limits<double>::quiet_NaN() : std::numeric_limits<double>::quiet_NaN();
+			return true;
+		}
+		auto in = std::istringstream{text};
+		in.imbue(std::locale::classic());
+		in >> out;
+		return !in.fail() && in.peek() == std::char_traits<char>::eof();
+	}
+
+	template<typename T>
+	static auto deserializeFloat(Lexer& lexer, T& out) -> bool {
+		auto text = std::string{};
+		if(!atomText(lexer, text)) return false;
+		auto val = 0.0;
+		if(!readDouble(text, val)) return notANumber(lexer, text);
+		out = static_cast<T>(val);
+		return true;
+	}
+
+	auto deserializeValue(Lexer& lexer, std::string& out) -> bool { return atomText(lexer, out); }
+	auto deserializeValue(Lexer& lexer, int& out) -> bool { return deserializeSigned(lexer, out); }
+	auto deserializeValue(Lexer& lexer, long& out) -> bool { return deserializeSigned(lexer, out); }
+	auto deserializeValue(Lexer& lexer, long long& out) -> bool { return deserializeSigned(lexer, out); }
+	auto deserializeValue(Lexer& lexer, unsigned& out) -> bool { return deserializeUnsigned(lexer, out); }
+	auto deserializeValue(Lexer& lexer, unsigned long& out) -> bool { return deserializeUnsigned(lexer, out); }
+	auto deserializeValue(Lexer& lexer, unsigned long long& out) -> bool { return deserializeUnsigned(lexer, out); }
+	auto deserializeValue(Lexer& lexer, float& out) -> bool { return deserializeFloat(lexer, out); }
+	auto deserializeValue(Lexer& lexer, double& out) -> bool { return deserializeFloat(lexer, out); }
+
+	auto deserializeValue(Lexer& lexer, bool& out) -> bool {
+		auto text = std::string{};
+		if(!atomText(lexer, text)) return false;
+		if(text == "true") out = true;
+		else if(text == "false") out = false;
+		else {
+			lexer.fail(lexer.tokbegin, "'" + text + "' is not true or false");
+			return false;
+		}
+		return true;
+	}
+
+	auto serializeValue(std::string& out, std::string const& value) -> void { appendStringVal(out, value); }
+	auto serializeValue(std::string& out, bool value) -> void { out += value ? "true" : "false"; }
+	auto serializeValue(std::string& out, int value) -> void { out += std::to_string(value); }
+	auto serializeValue(std::string& out, long value) -> void { out += std::to_string(value); }
+	auto serializeValue(std::string& out, long long value) -> void { out += std::to_string(value); }
+	auto serializeValue(std::string& out, unsigned value) -> void { out += std::to_string(value); }
+	auto serializeValue(std::string& out, unsigned long value) -> void { out += std::to_string(value); }
+	auto serializeValue(std::string& out, unsigned long long value) -> void { out += std::to_string(value); }
+	auto serializeValue(std::string& out, float value) -> void { serializeValue(out, static_cast<double>(value)); }
+
+	auto serializeValue(std::string& out, double value) -> void {
+		// the shortest of these that reads back as the same number, with a '.' whatever
+		// the locale
+		auto text = std::ostringstream{};
+		text.imbue(std::locale::classic());
+		text.precision(15);
+		text << value;
+		auto back = 0.0;
+		if(!readDouble(text.str(), back) || back != value) {
+			text.str(std::string{});
+			text.precision(17);
+			text << value;
+		}
+		out += text.str();
+	}
+
+	static auto escapeInto(std::string& dst, std::string const& str) -> void {
 		auto escape_count = countEscapeValues(str);
-		if(escape_count == 0) return str;
-		auto result_str = std::string{};
-		result_str.reserve(str.size() + escape_count);
+		if(escape_count == 0) {
+			dst.assign(str);
+			return;
+		}
+		dst.clear();
+		dst.reserve(str.size() + escape_count);
 		for(auto c : str) {
 			auto loc = std::find(escape_vals.begin(), escape_vals.end(), c);
-			if(loc == escape_vals.end()) result_str.push_back(c);
+			if(loc == escape_vals.end()) dst.push_back(c);
 			else {
-				result_str.push_back('\\');
-				result_str.push_back(escape_chars[loc - escape_vals.begin()]);
+				dst.push_back('\\');
+				dst.push_back(escape_chars[loc - escape_vals.begin()]);
 			}
 		}
+	}
+
+	auto escape(std::string const& str) -> std::string {
+		auto result_str = std::string{};
+		escapeInto(result_str, str);
 		return result_str;
 	}
 
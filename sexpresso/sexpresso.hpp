@@ -16,35 +16,590 @@ namespace sexpresso {
 
 	struct SexpArgumentIterator;
 
+	// offset is in bytes from the start of the input, line and column start at 1
+	struct SexpPosition {
+		size_t offset;
+		size_t line;
+		size_t column;
+	};
+
+	// Byte range [begin, end) of a node in the parsed text
+	struct SexpSpan {
+		size_t begin;
+		size_t end;
+	};
+
 	struct Sexp {
 		Sexp();
 		Sexp(std::string const& strval);
 		Sexp(std::vector<Sexp> const& sexpval);
+		Sexp(Sexp const& other);
+		Sexp(Sexp&& other) = default;
+		~Sexp();
+		auto operator=(Sexp const& other) -> Sexp&;
+		auto operator=(Sexp&& other) -> Sexp&;
 		SexpValueKind kind;
+		// Set by sortChildren. While set, lookups by name binary search the children and
+		// addChild inserts in order. transform, parallelTransform and reparse clear it
+		// when they leave the children out of order. Changing value.sexp directly doesn't,
+		// so sort again (or clear it) after doing that.
+		bool sorted = false;
 		struct { std::vector<Sexp> sexp; std::string str; } value;
 		auto addChild(Sexp sexp) -> void;
 		auto addChild(std::string str) -> void;
 		auto addChildUnescaped(std::string str) -> void;
 		auto addExpression(std::string const& str) -> void;
+		auto addExpression(std::string const& str, std::string& err) -> void; // leaves the Sexp untouched on error
 		auto childCount() const -> size_t;
 		auto getChild(size_t idx) -> Sexp&; // Call only if Sexp is a Sexp
 		auto getChild(size_t idx) const -> const Sexp&; // Call only if Sexp is a Sexp
 		auto getString() -> std::string&;
 		auto getString() const -> const std::string&;
 		auto getChildByPath(std::string const& path) -> Sexp*; // unsafe! careful to not have the result pointer outlive the scope of the Sexp object
+		auto getChildByPath(std::string const& path) const -> const Sexp*;
 		auto createPath(std::vector<std::string> const& path) -> Sexp&;
 		auto createPath(std::string const& path) -> Sexp&;
 		auto toString() const -> std::string;
+		// Same output as toString, but the top level children are split between threads
+		// (0 means one per hardware thread). Only worth it for big trees.
+		auto toStringParallel(unsigned threads = 0) const -> std::string;
 		auto isString() const -> bool;
 		auto isSexp() const -> bool;
 		auto isNil() const -> bool;
 		auto equal(Sexp const& other) const -> bool;
+		// A total order: atoms before lists, atoms by their string and lists by their
+		// children, one by one. Negative, zero or positive like std::string::compare.
+		auto compare(Sexp const& other) const -> int;
+		auto hash() const -> size_t; // equal trees hash the same
+		auto operator==(Sexp const& other) const -> bool;
+		auto operator!=(Sexp const& other) const -> bool;
+		auto operator<(Sexp const& other) const -> bool;
+		auto operator<=(Sexp const& other) const -> bool;
+		auto operator>(Sexp const& other) const -> bool;
+		auto operator>=(Sexp const& other) const -> bool;
 		auto arguments() -> SexpArgumentIterator;
+		// Stable sorts the children by the name createPath matches them by (the head of a
+		// list, or an atom itself) and sets sorted. An atom at the front is this list's
+		// own head and stays there. Big lists can be sorted in parallel.
+		auto sortChildren(unsigned threads = 1) -> void;
 		static auto unescaped(std::string strval) -> Sexp;
+		auto destroyChildren() -> void;
+	};
+
+	// Turns on per thread recycling of node memory, for trees that see a lot of adding
+	// and removing, or documents parsed one after another. While it's on, nodes
+	// destroyed on this thread put their child array and string in free lists sorted by
+	// size, up to 64 MiB in all. New atoms, the lists and atoms the parsers build, and
+	// full child arrays growing in addChild take memory from there first. Turning it
+	// off frees what the lists hold.
+	auto enableNodePool(bool enable) -> void;
+
+	// Makes createPath a hash lookup per level instead of a scan over the children, for
+	// building big trees. It remembers where children are, so while it's in use only
+	// add to the tree, through this or addChild, never remove or reorder (which
+	// includes adding to sorted lists).
+	struct SexpPathIndex {
+		SexpPathIndex(Sexp& root);
+		auto createPath(std::vector<std::string> const& path) -> Sexp&;
+		auto createPath(std::string const& path) -> Sexp&;
+		// Only walks the part of each path that differs from the one before it, so
+		// group paths with a common prefix together.
+		auto createPaths(std::vector<std::vector<std::string>> const& paths) -> void;
+
+		struct Node {
+			size_t childidx; // position in the parent's children
+			size_t hash; // of the name
+			size_t indexed; // children of this node that have been indexed so far
+			size_t count; // used slots
+			std::vector<size_t> slots; // open addressing table of node ids + 1
+		};
+		Sexp& root;
+		std::vector<Node> nodes; // nodes[0] is the root
+	};
+
+	// Counts changes to trees, for SexpPathCache. The members that change a tree
+	// (addChild, createPath, sortChildren, assignment, parsing into it, transform and
+	// friends) bump it whichever node they're called on, but only while a SexpPathCache
+	// exists. Lookups never touch it, so threads can share a tree they only read.
+	auto treeGeneration() -> uint64_t;
+	auto bumpTreeGeneration() -> void;
+
+	// Remembers what getChildByPath found for each path, so asking for the same paths
+	// again is one hash lookup. It starts over whenever treeGeneration changes, so
+	// after a change anywhere in the tree (or in any other one). Changes made to value
+	// directly go unnoticed, so call clear() after those.
+	struct SexpPathCache {
+		SexpPathCache(Sexp const& root);
+		SexpPathCache(SexpPathCache const& other);
+		~SexpPathCache();
+		auto getChildByPath(std::string const& path) -> Sexp const*;
+		auto clear() -> void;
+
+		struct Entry {
+			bool used;
+			size_t hash;
+			std::string path;
+			Sexp const* node; // nullptr if there's nothing at path
+		};
+		Sexp const& root;
+		uint64_t generation;
+		size_t count; // used slots
+		std::vector<Entry> slots; // open addressing table
 	};
 
 	auto parse(std::string const& str, std::string& err) -> Sexp;
 	auto parse(std::string const& str) -> Sexp;
+	// Same as above but also reports where the error happened
+	auto parse(std::string const& str, std::string& err, SexpPosition& errpos) -> Sexp;
+	// Also fills spans with the source range of every node, in the order a pre-order
+	// traversal visits them: spans[0] is the root, followed by its first child and
+	// that child's descendants, then its second child and so on.
+	auto parse(std::string const& str, std::string& err, SexpPosition& errpos, std::vector<SexpSpan>& spans) -> Sexp;
+	auto positionOf(std::string const& str, size_t offset) -> SexpPosition;
+	// Replaces the removed bytes starting at offset with inserted
+	struct SexpEdit {
+		size_t offset;
+		size_t removed;
+		std::string inserted;
+	};
+	// Applies edit to text, and updates tree and spans (as filled in by the parse above)
+	// to match without parsing everything again. Only the innermost list around the
+	// edit that still balances is parsed, and only until it gets back to a child the
+	// edit didn't touch, the rest of the tree is kept. On error tree is left empty and
+	// spans cleared like parse does, so the next call parses the whole text.
+	auto reparse(std::string& text, Sexp& tree, std::vector<SexpSpan>& spans, SexpEdit const& edit, std::string& err) -> void;
+	enum class TokenKind : uint8_t { OPEN, CLOSE, SYMBOL, STRING, END, ERROR };
+
+	// How the lexer treats each byte, as bits in char_classes. Spaces are the ones
+	// isspace has in the "C" locale, whatever the current locale is.
+	constexpr uint8_t char_space = 1;
+	constexpr uint8_t char_ends_symbol = 2; // spaces and parentheses
+	constexpr uint8_t char_ends_comment = 4;
+	constexpr uint8_t char_escape_value = 8; // stored escaped, see escape_vals
+	constexpr uint8_t char_string_special = 16; // needs a look inside a string literal
+	constexpr uint8_t char_escape_char = 32; // can follow a backslash in a string literal
+
+	// Indexed by the byte as an unsigned char, so bytes above 127 are fine (and plain
+	// symbol characters).
+	constexpr uint8_t char_classes[256] = {
+		0, 0, 0, 0, 0, 0, 0, 8, 8, 11, 31, 11, 11, 15, 0, 0, // \a \b \t \n \v \f \r
+		0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+		3, 0, 56, 0, 0, 0, 0, 40, 2, 2, 0, 0, 0, 0, 0, 0, // space " ' ( )
+		0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 40, // ?
+		0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+		0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 56, 0, 0, 0, // backslash
+		0, 32, 32, 0, 0, 0, 32, 0, 0, 0, 0, 0, 0, 0, 32, 0, // a b f n
+		0, 0, 32, 0, 32, 0, 32, 0, 0, 0, 0, 0, 0, 0, 0, 0, // r t v
+		0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+		0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+		0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+		0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+		0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+		0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+		0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+		0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	};
+
+	constexpr auto hasCharClass(char c, uint8_t classes) -> bool {
+		return (char_classes[static_cast<unsigned char>(c)] & classes) != 0;
+	}
+
+	// Splits the input into tokens without allocating. For SYMBOL and STRING tokens
+	// [tokbegin, tokend) is the raw text of the atom; for strings that is the text
+	// between the quotes, with escape sequences already validated. On ERROR the
+	// message is in err and errpos points at the offending character.
+	struct Lexer {
+		Lexer(char const* begin, char const* end);
+		Lexer(std::string const& str); // str has to outlive the lexer
+		Lexer(std::string&& str) = delete;
+		auto next() -> TokenKind;
+		auto peek() -> TokenKind; // the kind of the next token, without consuming it
+		auto skipSpace() -> void;
+		auto skipList() -> bool; // skips to the ')' closing the list the lexer is in
+		auto tokenIs(char const* str) const -> bool;
+		auto fail(char const* pos, std::string msg) -> TokenKind;
+		char const* begin;
+		char const* cur;
+		char const* end;
+		char const* tokbegin = nullptr;
+		char const* tokend = nullptr;
+		char const* errpos = nullptr;
+		std::string err;
+	};
+
+	// Iterates over the node indices of the children of a FlatSexp or SexpImage list
+	struct FlatChildIterator {
+		uint32_t const* sizes; // of the tree it iterates over
+		uint32_t node;
+		auto operator*() const -> uint32_t;
+		auto operator++() -> FlatChildIterator&;
+		auto operator!=(FlatChildIterator const& other) const -> bool;
+	};
+
+	struct FlatChildren {
+		FlatChildIterator first;
+		FlatChildIterator last;
+		auto begin() const -> FlatChildIterator;
+		auto end() const -> FlatChildIterator;
+	};
+
+	// A read only tree stored as arrays instead of one vector per node, which makes
+	// scanning it much faster. Nodes are numbered in pre-order with the root as 0, so
+	// the first child of a list is the node right after it and a node's next sibling
+	// comes right after its subtree. Atoms hold the same strings a Sexp would.
+	struct FlatSexp {
+		static constexpr uint32_t npos = uint32_t(-1);
+		auto size() const -> size_t; // number of nodes
+		auto isString(uint32_t node) const -> bool;
+		auto isSexp(uint32_t node) const -> bool;
+		auto childCount(uint32_t node) const -> size_t;
+		auto children(uint32_t node) const -> FlatChildren;
+		auto getChild(uint32_t node, size_t idx) const -> uint32_t;
+		auto stringData(uint32_t node) const -> char const*; // not null terminated
+		auto stringSize(uint32_t node) const -> size_t;
+		auto getString(uint32_t node) const -> std::string;
+		auto stringEquals(uint32_t node, std::string const& str) const -> bool;
+		auto getChildByPath(std::string const& path, uint32_t node = 0) const -> uint32_t; // npos if missing
+		auto toSexp(uint32_t node = 0) const -> Sexp;
+		std::vector<SexpValueKind> kinds;
+		std::vector<uint32_t> sizes; // nodes in the subtree, including the node itself
+		std::vector<uint32_t> offsets; // node i's string is pool[offsets[i], offsets[i + 1])
+		std::string pool;
+	};
+
+	// Node ids and string offsets are 32 bit, so a FlatSexp holds fewer than 2^32 nodes
+	// and at most 4 GiB of atom text. Bigger inputs fail with an error.
+	auto parseFlat(std::string const& str, std::string& err) -> FlatSexp;
+	auto parseFlat(std::string const& str) -> FlatSexp;
+	// Copies a tree into a FlatSexp. It measures the tree first, so however big it is
+	// the copy takes a handful of allocations, and copying the FlatSexp again is just
+	// copying its arrays. Cheap snapshots, that toSexp turns back into a tree.
+	auto flatten(Sexp const& root, std::string& err) -> FlatSexp;
+	auto flatten(Sexp const& root) -> FlatSexp;
+
+	// Lays out a FlatSexp as one block of bytes, to be written to a file and later
+	// used through a SexpImage straight from memory, typically mmapped. Offsets inside
+	// are relative to the start of the block and in the byte order of the machine that
+	// wrote it.
+	auto toImage(FlatSexp const& flat) -> std::string;
+
+	// A read only view of an image made by toImage, with the same node numbering and
+	// accessors as FlatSexp. Nothing is loaded or copied, the view just points into the
+	// image, so keep it alive (and mapped) for as long as the view is used.
+	struct SexpImage {
+		auto size() const -> size_t; // number of nodes
+		auto isString(uint32_t node) const -> bool;
+		auto isSexp(uint32_t node) const -> bool;
+		auto childCount(uint32_t node) const -> size_t;
+		auto children(uint32_t node) const -> FlatChildren;
+		auto arguments(uint32_t node) const -> FlatChildren; // the children after the head
+		auto getChild(uint32_t node, size_t idx) const -> uint32_t;
+		auto stringData(uint32_t node) const -> char const*; // not null terminated
+		auto stringSize(uint32_t node) const -> size_t;
+		auto getString(uint32_t node) const -> std::string;
+		auto stringEquals(uint32_t node, std::string const& str) const -> bool;
+		auto getChildByPath(std::string const& path, uint32_t node = 0) const -> uint32_t; // FlatSexp::npos if missing
+		auto toString(uint32_t node = 0) const -> std::string;
+		auto toSexp(uint32_t node = 0) const -> Sexp;
+		uint32_t nodes = 0;
+		SexpValueKind const* kinds = nullptr;
+		uint32_t const* sizes = nullptr;
+		uint32_t const* offsets = nullptr;
+		char const* pool = nullptr;
+	};
+
+	// Checks the header and that the sections fit in size bytes, nothing past that, so
+	// this takes the same time for any image. data has to be aligned to 8 bytes, which
+	// mmap and malloc both are.
+	auto viewImage(char const* data, size_t size, std::string& err) -> SexpImage;
+
+	// A filter on a query step: the node must have a child list headed by key, and if
+	// hasvalue is set that list's first argument must equal value.
+	struct SexpQueryPredicate {
+		std::string key;
+		std::string value;
+		bool hasvalue;
+	};
+
+	struct SexpQueryStep {
+		enum class Kind : uint8_t { NAME, ANY, DESCENDANTS };
+		Kind kind;
+		std::string name;
+		size_t position; // among the siblings matching the rest of the step, or npos
+		std::vector<SexpQueryPredicate> predicates;
+	};
+
+	// A compiled path query. Steps are separated by '/' and can be
+	//   name      a list headed by name, or at the last step a string equal to name
+	//   *         any list
+	//   **        any number of levels of lists, including none
+	// optionally followed by filters: [2] picks the third match among its siblings,
+	// [key] needs a (key ...) child and [key=value] a (key value ...) child. So
+	// "config/*/timeout", "**/endpoint" or "rules/rule[port=80][0]".
+	struct SexpQuery {
+		auto select(Sexp& root) const -> std::vector<Sexp*>; // all matches, in document order
+		std::vector<SexpQueryStep> steps; // at most 63
+	};
+
+	auto compileQuery(std::string const& query, std::string& err) -> SexpQuery;
+
+	// Keeps its scratch memory between calls, so parsing many small inputs with one
+	// long lived Parser (one per thread) skips most of the per call allocations.
+	struct Parser {
+		auto parse(std::string const& str, std::string& err) -> Sexp;
+		auto parse(std::string const& str) -> Sexp;
+		auto parse(std::string const& str, std::string& err, SexpPosition& errpos) -> Sexp;
+		auto parse(std::string const& str, std::string& err, SexpPosition& errpos, std::vector<SexpSpan>& spans) -> Sexp;
+		// Overwrites target with the parsed tree, reusing the child vectors and strings
+		// already in it where it can. On error target is left empty.
+		auto parseInto(Sexp& target, std::string const& str, std::string& err) -> void;
+		auto parseInto(Sexp& target, char const* begin, char const* end, std::string& err) -> void;
+		auto reset() -> void; // drops partially parsed nodes but keeps the capacity
+		std::vector<Sexp> nodes; // finished nodes whose parent list is still open
+		std::vector<size_t> frames; // index into nodes where each open list's children start
+		std::vector<size_t> openspans; // index into the spans of each open list
+		std::vector<Sexp*> targets; // lists parseInto is currently filling in
+	};
+
+	auto parseInto(Sexp& target, std::string const& str, std::string& err) -> void;
+	auto parseInto(Sexp& target, std::string const& str) -> void;
+
+	// Runs a query straight on the text instead of on a parsed tree. Everything that
+	// can't lead to a match is only tokenized and skipped, and a Sexp is built just for
+	// the matching nodes. Matches come out as they end, so one nested inside another
+	// match comes first. The returned Sexp is reused by the following call to next.
+	struct SexpQueryScanner {
+		SexpQueryScanner(SexpQuery query, char const* begin, char const* end);
+		SexpQueryScanner(SexpQuery query, std::string const& str); // str has to outlive the scanner
+		SexpQueryScanner(SexpQuery query, std::string&& str) = delete;
+		// Runs all the queries in the same pass over the input. Their steps share one
+		// 64 bit state set, so together they can have at most 64 steps, counting one
+		// extra for each query.
+		SexpQueryScanner(std::vector<SexpQuery> queries, char const* begin, char const* end);
+		SexpQueryScanner(std::vector<SexpQuery> queries, std::string const& str);
+		SexpQueryScanner(std::vector<SexpQuery> queries, std::string&& str) = delete;
+		auto next() -> Sexp*; // nullptr at the end of the input or on error
+		struct Frame {
+			uint64_t states; // the query steps the children of this list can match
+			size_t child;
+			char const* start; // where the list starts if it is a match itself
+		};
+		std::string err;
+		std::vector<size_t> matched; // indices of the queries the last match is for
+		std::vector<SexpQuery> queries;
+		std::vector<SexpQueryStep> steps; // of all queries, each followed by a spot for its accepting state
+		uint64_t accept = 0; // the accepting states
+		Lexer lexer;
+		Parser parser;
+		Sexp holder;
+		std::string scratch;
+		std::vector<Frame> frames;
+		std::vector<size_t> counts; // per frame and step, for steps with a position
+		auto advance(TokenKind tok, uint64_t states) -> uint64_t;
+		auto matches(SexpQueryStep const& step, TokenKind tok, bool last) -> bool;
+		auto deliver(char const* start, uint64_t states, bool root) -> Sexp*;
+		auto fail(std::string msg) -> Sexp*;
+	};
+
+	// Calls callback with every match of query in str, see SexpQueryScanner
+	template<typename F>
+	auto scanQuery(SexpQuery query, std::string const& str, F callback, std::string& err) -> void {
+		auto scanner = SexpQueryScanner{std::move(query), str};
+		while(auto match = scanner.next()) callback(*match);
+		if(!scanner.err.empty()) err = std::move(scanner.err);
+	}
+
+	// The same for several queries in a single pass, callback(match, i) is called for
+	// every query i the match is for
+	template<typename F>
+	auto scanQueries(std::vector<SexpQuery> queries, std::string const& str, F callback, std::string& err) -> void {
+		auto scanner = SexpQueryScanner{std::move(queries), str};
+		while(auto match = scanner.next()) {
+			for(auto i : scanner.matched) callback(*match, i);
+		}
+		if(!scanner.err.empty()) err = std::move(scanner.err);
+	}
+
+	// What a capture of a pattern matched: ?name binds one node, ?name... the nodes in
+	// [first, last)
+	struct SexpCapture {
+		Sexp const* first;
+		Sexp const* last;
+	};
+
+	// A compiled template like "(define ?name ?value)" or "(call ?fn ?args...)". Atoms
+	// have to match exactly, ?name matches any one node and ?name... matches any number
+	// of nodes in a list, at most one per list. Captures are numbered in the order
+	// they appear in the template.
+	struct SexpPattern {
+		// Fills captures, which is resized to names.size(), so reuse it and matching
+		// doesn't allocate
+		auto match(Sexp const& sexp, std::vector<SexpCapture>& captures) const -> bool;
+		auto slot(std::string const& name) const -> size_t; // npos if there's no such capture
+		struct Node {
+			enum class Kind : uint8_t { ATOM, LIST, CAPTURE, SPLICE };
+			Kind kind;
+			std::string text; // the atom, or the name of the capture
+			size_t size; // nodes in the subtree, including the node itself
+			size_t count; // children of a list
+			size_t splice; // which child of a list is a splice, or npos
+			size_t slot; // of a capture
+		};
+		std::vector<Node> nodes; // in pre-order, nodes[0] is the whole template
+		std::vector<std::string> names; // of the captures
+	};
+
+	auto compilePattern(std::string const& pattern, std::string& err) -> SexpPattern;
+
+	// Finds which of many patterns matches without trying them one by one. Patterns
+	// are grouped by their head atom and length, so only the few that could match a
+	// list with that head and that many children get tried. When several match, the
+	// one added first wins.
+	struct SexpDispatcher {
+		auto add(SexpPattern pattern) -> size_t; // returns an id, counting up from 0
+		auto match(Sexp const& sexp, std::vector<SexpCapture>& captures) const -> size_t; // id, or npos
+		struct Bucket {
+			std::string head;
+			size_t length; // npos for patterns with a splice
+			std::vector<size_t> ids;
+		};
+		std::vector<SexpPattern> patterns;
+		std::vector<Bucket> buckets; // sorted by head, then length
+		std::vector<size_t> unindexed; // patterns without an atom as head
+	};
+
+	// What a transform callback wants done with the node it was given. To replace a
+	// node, move the replacement into it and return KEEP.
+	enum class SexpAction : uint8_t {
+		KEEP,
+		SKIP, // keep the node but don't visit its children, only means something from pre
+		REMOVE,
+		SPLICE, // put a list's children in its place, from pre they get visited next
+	};
+
+	// Replaces list's child idx with its own children and returns how many there were.
+	// An atom is left alone and counts as 1. Splicing in children clears list.sorted.
+	auto spliceChild(Sexp& list, size_t idx) -> size_t;
+
+	// Clears list.sorted if its children are out of order, for after they were changed
+	// or replaced in place
+	auto recheckSorted(Sexp& list) -> void;
+
+	// Walks the tree depth first without recursing, calling pre(node) before visiting a
+	// node's children and post(node) after, unless pre removed or spliced it. Both
+	// return a SexpAction. Nodes are only ever moved, and the root can only be kept or
+	// replaced.
+	template<typename Pre, typename Post>
+	auto transform(Sexp& root, Pre pre, Post post) -> void {
+		struct Frame {
+			Sexp* list;
+			size_t read; // next child to visit
+			size_t write; // where the next kept child goes
+		};
+		// Moves the child at frame.read, which is done, to where it belongs
+		auto finish = [](Frame& frame, SexpAction action) {
+			auto& children = frame.list->value.sexp;
+			if(action == SexpAction::REMOVE) {
+				++frame.read;
+				return;
+			}
+			auto count = action == SexpAction::SPLICE ? spliceChild(*frame.list, frame.read) : size_t{1};
+			for(auto i = size_t{0}; i < count; ++i, ++frame.read, ++frame.write) {
+				if(frame.read != frame.write) children[frame.write] = std::move(children[frame.read]);
+			}
+		};
+		auto frames = std::vector<Frame>{};
+		if(pre(root) == SexpAction::KEEP && root.isSexp()) frames.push_back(Frame{&root, 0, 0});
+		else post(root);
+		while(!frames.empty()) {
+			auto& frame = frames.back();
+			auto& children = frame.list->value.sexp;
+			if(frame.read == children.size()) {
+				children.erase(children.begin() + frame.write, children.end());
+				auto& list = *frame.list;
+				recheckSorted(list);
+				frames.pop_back();
+				auto action = post(list);
+				if(!frames.empty()) finish(frames.back(), action);
+				continue;
+			}
+			auto& child = children[frame.read];
+			switch(pre(child)) {
+			case SexpAction::KEEP:
+				if(child.isSexp()) frames.push_back(Frame{&child, 0, 0});
+				else finish(frame, post(child));
+				break;
+			case SexpAction::SKIP:
+				finish(frame, post(child));
+				break;
+			case SexpAction::REMOVE:
+				++frame.read;
+				break;
+			case SexpAction::SPLICE:
+				if(!child.isSexp()) finish(frame, post(child));
+				else spliceChild(*frame.list, frame.read);
+				break;
+			}
+		}
+		bumpTreeGeneration();
+	}
+
+	// Compile time syntax check used by SEXPRESSO_LITERAL. From C++14 on it's a plain
+	// loop. C++11 constexpr functions can't loop, so there it recurses once per
+	// character, and literals longer than the compiler's constexpr depth (512 in GCC)
+	// need a bigger -fconstexpr-depth. Characters are classed by the lexer's table.
+#if __cplusplus >= 201402L
+	constexpr auto validLiteral(char const* s) -> bool {
+		auto depth = size_t{0};
+		while(*s != '\0') {
+			if(hasCharClass(*s, char_space)) {
+				++s;
+			} else if(*s == ';') {
+				while(*s != '\0' && !hasCharClass(*s, char_ends_comment)) ++s;
+			} else if(*s == '(') {
+				++depth;
+				++s;
+			} else if(*s == ')') {
+				if(depth == 0) return false;
+				--depth;
+				++s;
+			} else if(*s == '"') {
+				for(++s; *s != '"'; ++s) {
+					if(*s == '\0' || *s == '\n') return false;
+					if(*s == '\\' && !hasCharClass(*++s, char_escape_char)) return false;
+				}
+				++s;
+			} else {
+				while(*s != '\0' && !hasCharClass(*s, char_ends_symbol)) ++s;
+			}
+		}
+		return depth == 0;
+	}
+#else
+	constexpr auto validLiteral(char const* s, size_t depth = 0) -> bool;
+	constexpr auto validLiteralComment(char const* s, size_t depth) -> bool {
+		return (*s == '\0' || hasCharClass(*s, char_ends_comment)) ? validLiteral(s, depth) : validLiteralComment(s + 1, depth);
+	}
+	constexpr auto validLiteralSymbol(char const* s, size_t depth) -> bool {
+		return (*s == '\0' || hasCharClass(*s, char_ends_symbol)) ? validLiteral(s, depth) : validLiteralSymbol(s + 1, depth);
+	}
+	constexpr auto validLiteralString(char const* s, size_t depth) -> bool {
+		return *s == '\0' || *s == '\n' ? false
+			: *s == '"' ? validLiteral(s + 1, depth)
+			: *s == '\\' ? hasCharClass(s[1], char_escape_char) && validLiteralString(s + 2, depth)
+			: validLiteralString(s + 1, depth);
+	}
+	constexpr auto validLiteral(char const* s, size_t depth) -> bool {
+		return *s == '\0' ? depth == 0
+			: hasCharClass(*s, char_space) ? validLiteral(s + 1, depth)
+			: *s == ';' ? validLiteralComment(s + 1, depth)
+			: *s == '(' ? validLiteral(s + 1, depth + 1)
+			: *s == ')' ? depth != 0 && validLiteral(s + 1, depth - 1)
+			: *s == '"' ? validLiteralString(s + 1, depth)
+			: validLiteralSymbol(s + 1, depth);
+	}
+#endif
+
 	auto escape(std::string const& str) -> std::string;
 	auto printShouldNeverReachHere() -> void;
 
@@ -62,4 +617,309 @@ namespace sexpresso {
 		auto size() const -> size_t;
 		auto empty() const -> bool;
 	};
+
+	// Runs body(context, worker, i) for every i in [0, count) on up to threads threads
+	// (0 means one per core), with worker below parallelWorkers(count, threads). Each
+	// worker starts with an even share of the indices and when it runs out steals the
+	// back half of the biggest share left, so unevenly sized items still balance out.
+	// body must not throw.
+	auto parallelWorkers(size_t count, unsigned threads) -> unsigned;
+	auto parallelFor(size_t count, void (*body)(void* context, unsigned worker, size_t i), void* context, unsigned threads = 0) -> void;
+
+	// Calls fn(node) on every node of the tree in pre-order, without recursing
+	template<typename S, typename F>
+	auto visitNodes(S& root, F&& fn) -> void {
+		auto pending = std::vector<S*>{&root};
+		while(!pending.empty()) {
+			auto node = pending.back();
+			pending.pop_back();
+			fn(*node);
+			auto& children = node->value.sexp;
+			for(auto i = children.size(); i-- > 0;) pending.push_back(&children[i]);
+		}
+	}
+
+	// Splits the tree into subtrees for the workers of parallelForEachNode and
+	// parallelReduceNodes, going down level by level until there are at least want of
+	// them. The lists that get split up are passed to above before their children are
+	// looked at, like visitNodes does, so above may change them.
+	auto splitSubtrees(Sexp const& root, size_t want, void (*above)(void* context, Sexp const& node), void* context, std::vector<Sexp const*>& subtrees) -> void;
+
+	// fn(arg) on every argument, in parallel
+	template<typename F>
+	auto parallelForEach(SexpArgumentIterator args, F fn, unsigned threads = 0) -> void {
+		if(args.empty()) return;
+		struct Context { Sexp* first; F* fn; };
+		auto context = Context{args.sexp.value.sexp.data() + 1, &fn};
+		parallelFor(args.size(), [](void* c, unsigned, size_t i) {
+			auto& ctx = *static_cast<Context*>(c);
+			(*ctx.fn)(ctx.first[i]);
+		}, &context, threads);
+	}
+
+	// Replaces every argument with fn(arg), in parallel
+	template<typename F>
+	auto parallelTransform(SexpArgumentIterator args, F fn, unsigned threads = 0) -> void {
+		parallelForEach(args, [&fn](Sexp& arg) { arg = fn(arg); }, threads);
+		recheckSorted(args.sexp);
+		bumpTreeGeneration();
+	}
+
+	// combine(init, map(arg)) over all arguments, in parallel, so combine has to be
+	// associative and commutative
+	template<typename T, typename M, typename C>
+	auto parallelReduce(SexpArgumentIterator args, T init, M map, C combine, unsigned threads = 0) -> T {
+		struct Context { Sexp* first; M* map; C* combine; std::vector<T> partials; std::vector<char> started; };
+		if(args.empty()) return init;
+		auto workers = parallelWorkers(args.size(), threads);
+		auto context = Context{args.sexp.value.sexp.data() + 1, &map, &combine, std::vector<T>(workers, init), std::vector<char>(workers, 0)};
+		parallelFor(args.size(), [](void* c, unsigned worker, size_t i) {
+			auto& ctx = *static_cast<Context*>(c);
+			auto& partial = ctx.partials[worker];
+			partial = ctx.started[worker] ? (*ctx.combine)(partial, (*ctx.map)(ctx.first[i])) : (*ctx.map)(ctx.first[i]);
+			ctx.started[worker] = 1;
+		}, &context, threads);
+		for(auto w = 0u; w < workers; ++w) {
+			if(context.started[w]) init = combine(init, context.partials[w]);
+		}
+		return init;
+	}
+
+	// fn(node) on every node of the tree, in parallel and in no particular order. Like
+	// visitNodes, a node's children are read after fn has run on it, so fn may change
+	// the node it gets, but no other node.
+	template<typename F>
+	auto parallelForEachNode(Sexp& root, F fn, unsigned threads = 0) -> void {
+		struct Context { Sexp* const* subtrees; F* fn; };
+		auto subtrees = std::vector<Sexp const*>{};
+		// the tree isn't const, splitSubtrees just doesn't need to modify it
+		splitSubtrees(root, 16 * size_t(parallelWorkers(size_t(-1), threads)), [](void* f, Sexp const& node) {
+			(*static_cast<F*>(f))(const_cast<Sexp&>(node));
+		}, &fn, subtrees);
+		auto context = Context{const_cast<Sexp* const*>(subtrees.data()), &fn};
+		parallelFor(subtrees.size(), [](void* c, unsigned, size_t i) {
+			auto& ctx = *static_cast<Context*>(c);
+			visitNodes(*ctx.subtrees[i], *ctx.fn);
+		}, &context, threads);
+		bumpTreeGeneration();
+	}
+
+	// combine(init, map(node)) over every node of the tree, in parallel
+	template<typename T, typename M, typename C>
+	auto parallelReduceNodes(Sexp const& root, T init, M map, C combine, unsigned threads = 0) -> T {
+		struct Context { Sexp const* const* subtrees; M* map; C* combine; std::vector<T> partials; std::vector<char> started; };
+		struct Above { T* init; M* map; C* combine; };
+		auto subtrees = std::vector<Sexp const*>{};
+		auto above = Above{&init, &map, &combine};
+		splitSubtrees(root, 16 * size_t(parallelWorkers(size_t(-1), threads)), [](void* a, Sexp const& node) {
+			auto& ctx = *static_cast<Above*>(a);
+			*ctx.init = (*ctx.combine)(*ctx.init, (*ctx.map)(node));
+		}, &above, subtrees);
+		auto workers = parallelWorkers(subtrees.size(), threads);
+		auto context = Context{subtrees.data(), &map, &combine, std::vector<T>(workers, init), std::vector<char>(workers, 0)};
+		parallelFor(subtrees.size(), [](void* c, unsigned worker, size_t i) {
+			auto& ctx = *static_cast<Context*>(c);
+			auto& partial = ctx.partials[worker];
+			visitNodes(*ctx.subtrees[i], [&](Sexp const& node) {
+				partial = ctx.started[worker] ? (*ctx.combine)(partial, (*ctx.map)(node)) : (*ctx.map)(node);
+				ctx.started[worker] = 1;
+			});
+		}, &context, threads);
+		for(auto w = 0u; w < workers; ++w) {
+			if(context.started[w]) init = combine(init, context.partials[w]);
+		}
+		return init;
+	}
+
+	// Describes how a struct maps to an s-expression, for deserialize and serialize. Specialize it
+	// for your own types:
+	//
+	//   template<> struct SexpFields<Point> {
+	//     static auto head() -> char const* { return "point"; }
+	//     template<typename P, typename V> static auto visit(P& p, V& v) -> bool {
+	//       return v("x", p.x) || v("y", p.y) || v("tags", p.tags);
+	//     }
+	//   };
+	//
+	// reads (point (x 1) (y 2) (tags a b c)). A field holding a std::vector takes all
+	// of the values left in its list, other fields take exactly one. Fields that are
+	// missing from the input are left alone and unknown ones are skipped.
+	template<typename T> struct SexpFields;
+
+	// Reads the next value from the lexer, without building a Sexp
+	auto deserializeValue(Lexer& lexer, std::string& out) -> bool;
+	auto deserializeValue(Lexer& lexer, bool& out) -> bool;
+	auto deserializeValue(Lexer& lexer, int& out) -> bool;
+	auto deserializeValue(Lexer& lexer, long& out) -> bool;
+	auto deserializeValue(Lexer& lexer, long long& out) -> bool;
+	auto deserializeValue(Lexer& lexer, unsigned& out) -> bool;
+	auto deserializeValue(Lexer& lexer, unsigned long& out) -> bool;
+	auto deserializeValue(Lexer& lexer, unsigned long long& out) -> bool;
+	auto deserializeValue(Lexer& lexer, float& out) -> bool;
+	auto deserializeValue(Lexer& lexer, double& out) -> bool;
+	template<typename T> auto deserializeValue(Lexer& lexer, std::vector<T>& out) -> bool;
+	template<typename T> auto deserializeValue(Lexer& lexer, T& out) -> bool;
+	// Reads the rest of a field's list, including the closing ')'
+	template<typename T> auto deserializeArguments(Lexer& lexer, T& out) -> bool;
+	template<typename T> auto deserializeArguments(Lexer& lexer, std::vector<T>& out) -> bool;
+
+	auto expectHead(Lexer& lexer, char const* head) -> bool;
+	auto expectClose(Lexer& lexer) -> bool;
+	auto unexpectedToken(Lexer& lexer, TokenKind tok) -> bool;
+
+	// The visitor deserializeValue passes to SexpFields::visit
+	struct SexpFieldReader {
+		Lexer& lexer;
+		bool found;
+		bool ok;
+		template<typename F> auto operator()(char const* name, F& value) -> bool {
+			if(!this->lexer.tokenIs(name)) return false;
+			this->found = true;
+			this->ok = deserializeArguments(this->lexer, value);
+			return true;
+		}
+	};
+
+	template<typename T>
+	auto deserializeValue(Lexer& lexer, std::vector<T>& out) -> bool {
+		auto tok = lexer.next();
+		if(tok != TokenKind::OPEN) return unexpectedToken(lexer, tok);
+		return deserializeArguments(lexer, out);
+	}
+
+	template<typename T>
+	auto deserializeValue(Lexer& lexer, T& out) -> bool {
+		if(!expectHead(lexer, SexpFields<T>::head())) return false;
+		for(;;) {
+			auto tok = lexer.next();
+			switch(tok) {
+			case TokenKind::CLOSE:
+				return true;
+			case TokenKind::OPEN: {
+				tok = lexer.next();
+				if(tok != TokenKind::SYMBOL) return unexpectedToken(lexer, tok);
+				auto reader = SexpFieldReader{lexer, false, false};
+				SexpFields<T>::visit(out, reader);
+				if(!reader.found && !lexer.skipList()) return false;
+				if(reader.found && !reader.ok) return false;
+				break;
+			}
+			case TokenKind::SYMBOL:
+			case TokenKind::STRING:
+				break; // stray atoms are ignored like unknown fields
+			default:
+				return unexpectedToken(lexer, tok);
+			}
+		}
+	}
+
+	template<typename T>
+	auto deserializeArguments(Lexer& lexer, T& out) -> bool {
+		return deserializeValue(lexer, out) && expectClose(lexer);
+	}
+
+	template<typename T>
+	auto deserializeArguments(Lexer& lexer, std::vector<T>& out) -> bool {
+		out.clear();
+		for(;;) {
+			if(lexer.peek() == TokenKind::CLOSE) {
+				lexer.next();
+				return true;
+			}
+			out.emplace_back();
+			if(!deserializeValue(lexer, out.back())) return false;
+		}
+	}
+
+	// Fills out straight from the text of a single value, e.g. one struct
+	template<typename T>
+	auto deserialize(std::string const& str, T& out, std::string& err) -> void {
+		auto lexer = Lexer{str};
+		if(deserializeValue(lexer, out)) {
+			auto tok = lexer.next();
+			if(tok == TokenKind::END) return;
+			unexpectedToken(lexer, tok);
+		}
+		err = std::move(lexer.err);
+	}
+
+	// Appends the text of a value, quoting strings the same way toString does
+	auto serializeValue(std::string& out, std::string const& value) -> void;
+	auto serializeValue(std::string& out, bool value) -> void;
+	auto serializeValue(std::string& out, int value) -> void;
+	auto serializeValue(std::string& out, long value) -> void;
+	auto serializeValue(std::string& out, long long value) -> void;
+	auto serializeValue(std::string& out, unsigned value) -> void;
+	auto serializeValue(std::string& out, unsigned long value) -> void;
+	auto serializeValue(std::string& out, unsigned long long value) -> void;
+	auto serializeValue(std::string& out, float value) -> void;
+	auto serializeValue(std::string& out, double value) -> void;
+	template<typename T> auto serializeValue(std::string& out, std::vector<T> const& value) -> void;
+	template<typename T> auto serializeValue(std::string& out, T const& value) -> void;
+	// Appends the values of a field, each after a space, a vector's elements one after
+	// another. An empty vector appends nothing, so the field prints as (name).
+	template<typename T> auto serializeArguments(std::string& out, T const& value) -> void;
+	template<typename T> auto serializeArguments(std::string& out, std::vector<T> const& value) -> void;
+
+	// The visitor serializeValue passes to SexpFields::visit
+	struct SexpFieldWriter {
+		std::string& out;
+		template<typename F> auto operator()(char const* name, F const& value) -> bool {
+			this->out += " (";
+			this->out += name;
+			serializeArguments(this->out, value);
+			this->out.push_back(')');
+			return false; // keep visiting
+		}
+	};
+
+	template<typename T>
+	auto serializeValue(std::string& out, std::vector<T> const& value) -> void {
+		out.push_back('(');
+		for(auto i = value.begin(); i != value.end(); ++i) {
+			if(i != value.begin()) out.push_back(' ');
+			serializeValue(out, *i);
+		}
+		out.push_back(')');
+	}
+
+	template<typename T>
+	auto serializeValue(std::string& out, T const& value) -> void {
+		out.push_back('(');
+		out += SexpFields<T>::head();
+		auto writer = SexpFieldWriter{out};
+		SexpFields<T>::visit(value, writer);
+		out.push_back(')');
+	}
+
+	template<typename T>
+	auto serializeArguments(std::string& out, T const& value) -> void {
+		out.push_back(' ');
+		serializeValue(out, value);
+	}
+
+	template<typename T>
+	auto serializeArguments(std::string& out, std::vector<T> const& value) -> void {
+		for(auto& element : value) {
+			out.push_back(' ');
+			serializeValue(out, element);
+		}
+	}
+
+	// The text of a value, without building a Sexp first
+	template<typename T>
+	auto serialize(T const& value) -> std::string {
+		auto out = std::string{};
+		serializeValue(out, value);
+		return out;
+	}
 }
+
+// Evaluates to a const Sexp& for a string literal whose syntax is checked at compile
+// time. The literal is parsed once, the first time the expression is evaluated.
+#define SEXPRESSO_LITERAL(str) \
+	([]() -> sexpresso::Sexp const& { \
+		static_assert(sexpresso::validLiteral(str), "invalid s-expression literal: " str); \
+		static auto const sexp = sexpresso::parse(str); \
+		return sexp; \
+	}())
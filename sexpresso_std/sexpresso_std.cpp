@@ -5,6 +5,8 @@
 #include <string>
 #include <cstdint>
 #include <ostream>
+#include <istream>
+#include <functional>
 #include "sexpresso.hpp"
 #include "sexpresso_std.hpp"
 
@@ -13,4 +15,126 @@ namespace sexpresso_std {
 		ostream << sexp.toString();
 		return ostream;
 	}
+
+	static const auto read_chunk_size = size_t{64 * 1024};
+
+	FormReader::FormReader(std::istream& stream)
+		: stream(stream), start(0), scan(0), depth(0), instring(false), escaped(false), incomment(false), insymbol(false) {}
+
+	// Looks for the end of the form starting at reader.start, following the same rules
+	// as the lexer. Returns the offset just past it, or 0 if more input is needed.
+	static auto findFormEnd(FormReader& r) -> size_t {
+		auto& buf = r.buffer;
+		for(; r.scan < buf.size(); ++r.scan) {
+			auto c = buf[r.scan];
+			if(r.incomment) {
+				if(sexpresso::hasCharClass(c, sexpresso::char_ends_comment)) r.incomment = false;
+				continue;
+			}
+			if(r.instring) {
+				// The lexer rejects a newline in a string, so end the form there and let
+				// the parser report it instead of buffering the rest of the input
+				if(c == '\n') return ++r.scan;
+				if(r.escaped) r.escaped = false;
+				else if(c == '\\') r.escaped = true;
+				else if(c == '"') {
+					r.instring = false;
+					if(r.depth == 0) return ++r.scan;
+				}
+				continue;
+			}
+			if(r.insymbol) {
+				if(!sexpresso::hasCharClass(c, sexpresso::char_ends_symbol)) continue;
+				r.insymbol = false;
+				if(r.depth == 0) return r.scan;
+			}
+			switch(c) {
+			case ';':
+				r.incomment = true;
+				break;
+			case '"':
+				r.instring = true;
+				break;
+			case '(':
+				++r.depth;
+				break;
+			case ')':
+				// a stray ')' at the top ends up alone in its form, so the parser reports it
+				if(r.depth == 0 || --r.depth == 0) return ++r.scan;
+				break;
+			default:
+				if(!sexpresso::hasCharClass(c, sexpresso::char_space)) r.insymbol = true;
+			}
+		}
+		return 0;
+	}
+
+	auto FormReader::next() -> bool {
+		if(!this->err.empty()) return false;
+		for(;;) {
+			auto end = findFormEnd(*this);
+			auto eof = false;
+			if(end == 0) {
+				// Drop consumed input before reading more, so the buffer only grows
+				// with the size of the largest form.
+				if(this->start != 0) {
+					this->buffer.erase(0, this->start);
+					this->scan -= this->start;
+					this->start = 0;
+				}
+				if(this->stream) {
+					auto size = this->buffer.size();
+					this->buffer.resize(size + read_chunk_size);
+					this->stream.read(&this->buffer[size], read_chunk_size);
+					this->buffer.resize(size + this->stream.gcount());
+					continue;
+				}
+				eof = true;
+				end = this->buffer.size();
+			}
+			auto data = this->buffer.data();
+			this->parser.parseInto(this->holder, data + this->start, data + end, this->err);
+			this->start = end;
+			if(!this->err.empty()) return false;
+			if(this->holder.childCount() != 0) return true;
+			if(eof) return false; // only whitespace and comments were left
+		}
+	}
+
+	auto FormReader::current() -> sexpresso::Sexp& {
+		return this->holder.getChild(0);
+	}
+
+	auto FormReader::begin() -> FormIterator {
+		return FormIterator{this->next() ? this : nullptr};
+	}
+
+	auto FormReader::end() -> FormIterator {
+		return FormIterator{nullptr};
+	}
+
+	auto FormIterator::operator*() const -> sexpresso::Sexp& {
+		return this->reader->current();
+	}
+
+	auto FormIterator::operator->() const -> sexpresso::Sexp* {
+		return &this->reader->current();
+	}
+
+	auto FormIterator::operator++() -> FormIterator& {
+		if(!this->reader->next()) this->reader = nullptr;
+		return *this;
+	}
+
+	auto FormIterator::operator==(FormIterator const& other) const -> bool {
+		return this->reader == other.reader;
+	}
+
+	auto FormIterator::operator!=(FormIterator const& other) const -> bool {
+		return this->reader != other.reader;
+	}
+
+	auto readForms(std::istream& stream) -> FormReader {
+		return FormReader{stream};
+	}
 }
@@ -6,10 +6,56 @@
 #ifndef SEXPRESSO_STD_HEADER
 #define SEXPRESSO_STD_HEADER
 #include <ostream>
+#include <istream>
+#include <functional>
 // #include "sexpresso_std.hpp"
 #endif
 #endif
 
 namespace sexpresso_std {
 	auto operator<<(std::ostream& ostream, sexpresso::Sexp const& sexp) -> std::ostream&;
+
+	struct FormReader;
+
+	struct FormIterator {
+		FormReader* reader; // nullptr once the input has run out
+		auto operator*() const -> sexpresso::Sexp&;
+		auto operator->() const -> sexpresso::Sexp*;
+		auto operator++() -> FormIterator&;
+		auto operator==(FormIterator const& other) const -> bool;
+		auto operator!=(FormIterator const& other) const -> bool;
+	};
+
+	// Reads the top level forms of a stream one at a time, so only the current form
+	// and a chunk of unread input are ever kept in memory. The form returned by
+	// current() is overwritten by the next call to next(), reusing its memory.
+	struct FormReader {
+		FormReader(std::istream& stream);
+		auto next() -> bool; // false at the end of the input or on error
+		auto current() -> sexpresso::Sexp&;
+		auto begin() -> FormIterator;
+		auto end() -> FormIterator;
+
+		std::istream& stream;
+		std::string err; // set when reading stopped because of a parse error
+		std::string buffer; // unread input starts at start
+		size_t start;
+		size_t scan; // how far into buffer the end of the next form has been looked for
+		size_t depth;
+		bool instring;
+		bool escaped;
+		bool incomment;
+		bool insymbol;
+		sexpresso::Sexp holder; // parsed into in place, the form is its only child
+		sexpresso::Parser parser;
+	};
+
+	auto readForms(std::istream& stream) -> FormReader;
+}
+
+namespace std {
+	// So trees can be keys of unordered containers
+	template<> struct hash<sexpresso::Sexp> {
+		auto operator()(sexpresso::Sexp const& sexp) const -> size_t { return sexp.hash(); }
+	};
 }
@@ -8,6 +8,12 @@
 #include <cstdint>
 #include "sexpresso.hpp"
 
+#include <type_traits>
+#include <thread>
+#include <cstring>
+#include <clocale>
+#include <cstdio>
+
 TEST_CASE("Empty string") {
 	auto str = std::string{};
 	REQUIRE(str.empty());
@@ -191,3 +197,915 @@ TEST_CASE("toString with comma") {
 	auto s = sexpresso::parse(str, err);
 	REQUIRE(s.toString() == "(a ((b , (c d))))");
 }
+
+TEST_CASE("Deep nesting") {
+	auto depth = 1000000u;
+	auto str = std::string(depth, '(') + "deep" + std::string(depth, ')');
+	auto err = std::string{};
+	auto s = sexpresso::parse(str, err);
+	REQUIRE(err.empty());
+	REQUIRE(s.toString() == str);
+
+	auto copy = s;
+	REQUIRE(copy.equal(s));
+	copy.addChild("diff");
+	REQUIRE(!copy.equal(s));
+}
+
+TEST_CASE("Error positions") {
+	auto err = std::string{};
+	auto pos = sexpresso::SexpPosition{};
+
+	sexpresso::parse("(a b)\n(c \"unterminated)", err, pos);
+	REQUIRE(err == "Unterminated string literal");
+	REQUIRE(pos.offset == 9);
+	REQUIRE(pos.line == 2);
+	REQUIRE(pos.column == 4);
+
+	err.clear();
+	sexpresso::parse("(a (b)\n  c))", err, pos);
+	REQUIRE(!err.empty());
+	REQUIRE(pos.line == 2);
+	REQUIRE(pos.column == 5);
+
+	err.clear();
+	sexpresso::parse("(a\n (b (c)\n d)", err, pos);
+	REQUIRE(!err.empty());
+	REQUIRE(pos.line == 1);
+	REQUIRE(pos.column == 1);
+
+	err.clear();
+	sexpresso::parse("(\"bad \\q escape\")", err, pos);
+	REQUIRE(err == "invalid escape char 'q'");
+	REQUIRE(pos.offset == 6);
+}
+
+TEST_CASE("Node spans") {
+	auto str = std::string{"(hi \"there you\") ; comment\n(x (y))"};
+	auto err = std::string{};
+	auto pos = sexpresso::SexpPosition{};
+	auto spans = std::vector<sexpresso::SexpSpan>{};
+	auto s = sexpresso::parse(str, err, pos, spans);
+	REQUIRE(err.empty());
+	REQUIRE(s.toString() == "(hi \"there you\") (x (y))");
+
+	auto text = [&](size_t i) { return str.substr(spans[i].begin, spans[i].end - spans[i].begin); };
+	REQUIRE(spans.size() == 8);
+	REQUIRE(text(0) == str);
+	REQUIRE(text(1) == "(hi \"there you\")");
+	REQUIRE(text(2) == "hi");
+	REQUIRE(text(3) == "\"there you\"");
+	REQUIRE(text(4) == "(x (y))");
+	REQUIRE(text(5) == "x");
+	REQUIRE(text(6) == "(y)");
+	REQUIRE(text(7) == "y");
+}
+
+TEST_CASE("Reusable parser") {
+	auto parser = sexpresso::Parser{};
+	auto err = std::string{};
+
+	auto a = parser.parse("(msg (id 1) (body \"hello there\"))", err);
+	REQUIRE(err.empty());
+	REQUIRE(a.toString() == "(msg (id 1) (body \"hello there\"))");
+
+	parser.parse("(msg (id 2)", err);
+	REQUIRE(!err.empty());
+
+	err.clear();
+	auto b = parser.parse("(msg (id 3)) (msg)", err);
+	REQUIRE(err.empty());
+	REQUIRE(b.equal(sexpresso::parse("(msg (id 3)) (msg)")));
+	REQUIRE(parser.nodes.empty());
+	REQUIRE(parser.frames.empty());
+}
+
+TEST_CASE("Parse into existing tree") {
+	auto parser = sexpresso::Parser{};
+	auto err = std::string{};
+	auto target = sexpresso::parse("leftover (stuff (that goes)) away");
+
+	parser.parseInto(target, "(point (x 1) (y \"two\"))", err);
+	REQUIRE(err.empty());
+	REQUIRE(target.equal(sexpresso::parse("(point (x 1) (y \"two\"))")));
+
+	auto* children = target.getChild(0).value.sexp.data();
+	parser.parseInto(target, "(point (x 3) (y four))", err);
+	REQUIRE(err.empty());
+	REQUIRE(target.toString() == "(point (x 3) (y four))");
+	REQUIRE(target.getChild(0).value.sexp.data() == children);
+
+	parser.parseInto(target, "(x) y", err);
+	REQUIRE(err.empty());
+	REQUIRE(target.toString() == "(x) y");
+
+	sexpresso::parseInto(target, "(unclosed", err);
+	REQUIRE(!err.empty());
+	REQUIRE(target.isNil());
+}
+
+TEST_CASE("Add Expression errors") {
+	auto s = sexpresso::parse("(log (entry 1))");
+	auto& log = *s.getChildByPath("log");
+	auto err = std::string{};
+
+	log.addExpression("(entry 2) (entry \"three\")", err);
+	REQUIRE(err.empty());
+	REQUIRE(s.toString() == "(log (entry 1) (entry 2) (entry three))");
+
+	log.addExpression("(entry 4) (entry", err);
+	REQUIRE(!err.empty());
+	REQUIRE(s.toString() == "(log (entry 1) (entry 2) (entry three))");
+
+	err.clear();
+	auto str = sexpresso::Sexp{"head"};
+	str.addExpression("tail (end)", err);
+	REQUIRE(err.empty());
+	REQUIRE(str.toString() == "head tail (end)");
+}
+
+TEST_CASE("Indexed create path") {
+	auto plain = sexpresso::parse("(config (existing 1) name)");
+	auto indexed = plain;
+
+	auto keys = std::vector<std::string>{};
+	for(auto i = 0; i < 2000; ++i) keys.push_back("config/key" + std::to_string(i % 1000) + "/value");
+	keys.push_back("config/existing/more");
+	keys.push_back("config/name/x");
+
+	auto index = sexpresso::SexpPathIndex{indexed};
+	auto samenode = true;
+	for(auto& k : keys) {
+		auto& a = plain.createPath(k);
+		auto& b = index.createPath(k);
+		samenode = samenode && &b == indexed.getChildByPath(k);
+		a.addChild("1");
+		b.addChild("1");
+	}
+	REQUIRE(samenode);
+	REQUIRE(indexed.equal(plain));
+
+	auto batched = sexpresso::parse("(config (existing 1) name)");
+	auto batch = std::vector<std::vector<std::string>>{};
+	for(auto i = 0; i < 1000; ++i) {
+		batch.push_back({"config", "key" + std::to_string(i), "value"});
+		batch.push_back({"config", "key" + std::to_string(i), "other"});
+	}
+	sexpresso::SexpPathIndex{batched}.createPaths(batch);
+	REQUIRE(batched.getChildByPath("config/key999/other") != nullptr);
+	REQUIRE(batched.getChildByPath("config")->childCount() == 1003);
+}
+
+static_assert(sexpresso::validLiteral("(a (b \"c \\\"d\\\"\")) ; note\n e"), "valid literal");
+static_assert(!sexpresso::validLiteral("(a (b)"), "unclosed list");
+static_assert(!sexpresso::validLiteral("(a))"), "too many ')'");
+static_assert(!sexpresso::validLiteral("(a \"b)"), "unterminated string");
+static_assert(!sexpresso::validLiteral("\"\\q\""), "invalid escape");
+static_assert(!sexpresso::validLiteral("\"a\\"), "escape at the end");
+static_assert(sexpresso::validLiteral("a;b \"c\" d\"e"), "';' and '\"' inside symbols");
+
+#if __cplusplus >= 201402L
+#define TEST_RULE " (rule (match \"some pattern\" x y) (action (log \"hit\")))"
+#define TEST_RULES TEST_RULE TEST_RULE TEST_RULE TEST_RULE TEST_RULE
+// Far longer than the C++11 recursion allows by default
+static_assert(sexpresso::validLiteral("(rules" TEST_RULES TEST_RULES TEST_RULES TEST_RULES ")"), "long literal");
+static_assert(!sexpresso::validLiteral("(rules" TEST_RULES TEST_RULES TEST_RULES TEST_RULES), "long unclosed literal");
+#undef TEST_RULES
+#undef TEST_RULE
+#endif
+
+static auto templateSexp() -> sexpresso::Sexp const& {
+	return SEXPRESSO_LITERAL("(template (name greeting) (body \"hello there\"))");
+}
+
+TEST_CASE("Compile time checked literals") {
+	auto& t = templateSexp();
+	REQUIRE(&t == &templateSexp());
+	REQUIRE(t.toString() == "(template (name greeting) (body \"hello there\"))");
+	auto name = t.getChildByPath("template/name");
+	REQUIRE(name != nullptr);
+	REQUIRE(name->getChild(1).getString() == "greeting");
+}
+
+struct TestEndpoint {
+	std::string host;
+	unsigned port = 0;
+};
+
+struct TestService {
+	std::string name;
+	double timeout = 0;
+	bool enabled = false;
+	std::vector<std::string> tags;
+	std::vector<TestEndpoint> endpoints;
+};
+
+namespace sexpresso {
+	template<> struct SexpFields<TestEndpoint> {
+		static auto head() -> char const* { return "endpoint"; }
+		template<typename P, typename V> static auto visit(P& p, V& v) -> bool {
+			return v("host", p.host) || v("port", p.port);
+		}
+	};
+
+	template<> struct SexpFields<TestService> {
+		static auto head() -> char const* { return "service"; }
+		template<typename P, typename V> static auto visit(P& p, V& v) -> bool {
+			return v("name", p.name) || v("timeout", p.timeout) || v("enabled", p.enabled)
+				|| v("tags", p.tags) || v("endpoints", p.endpoints);
+		}
+	};
+}
+
+TEST_CASE("Deserialize structs") {
+	auto err = std::string{};
+	auto svc = TestService{};
+	sexpresso::deserialize("(service (name \"auth api\") (unknown (a b) c) (timeout 2.5) (enabled true)"
+		" (tags fast internal) (endpoints (endpoint (host a.local) (port 80)) (endpoint (port 443) (host b))))", svc, err);
+	REQUIRE(err.empty());
+	REQUIRE(svc.name == "auth api");
+	REQUIRE(svc.timeout == 2.5);
+	REQUIRE(svc.enabled);
+	REQUIRE(svc.tags.size() == 2);
+	REQUIRE(svc.tags[1] == "internal");
+	REQUIRE(svc.endpoints.size() == 2);
+	REQUIRE(svc.endpoints[0].host == "a.local");
+	REQUIRE(svc.endpoints[0].port == 80);
+	REQUIRE(svc.endpoints[1].host == "b");
+	REQUIRE(svc.endpoints[1].port == 443);
+
+	auto ep = TestEndpoint{};
+	sexpresso::deserialize("(endpoint (port -1))", ep, err);
+	REQUIRE(err == "'-1' is not a valid number");
+
+	err.clear();
+	sexpresso::deserialize("(service (name a b))", svc, err);
+	REQUIRE(!err.empty());
+
+	err.clear();
+	sexpresso::deserialize("(endpoint (host x)", ep, err);
+	REQUIRE(err == "unexpected end of input");
+}
+
+// Switches LC_NUMERIC to a locale that writes 1.5 as "1,5", if the system has one
+static auto useCommaLocale() -> bool {
+	for(auto name : {"de_DE.UTF-8", "de_DE.utf8", "de_DE", "fr_FR.UTF-8", "fr_FR.utf8", "fr_FR", "German_Germany.1252"}) {
+		if(std::setlocale(LC_NUMERIC, name) == nullptr) continue;
+		char buf[8];
+		std::snprintf(buf, sizeof buf, "%g", 1.5);
+		if(std::string{buf} == "1,5") return true;
+	}
+	std::setlocale(LC_NUMERIC, "C");
+	return false;
+}
+
+TEST_CASE("Struct numbers don't depend on the locale") {
+	if(!useCommaLocale()) WARN("no locale with a decimal comma installed, only the C locale is checked");
+	auto err = std::string{};
+	auto svc = TestService{};
+	sexpresso::deserialize("(service (timeout 2.5))", svc, err);
+	auto read = svc.timeout;
+	sexpresso::deserialize("(service (timeout 2,5))", svc, err);
+	svc = TestService{};
+	svc.timeout = 2.5;
+	auto written = sexpresso::serialize(svc);
+	svc.timeout = 0.1 + 0.2;
+	auto precise = sexpresso::serialize(svc);
+	std::setlocale(LC_NUMERIC, "C");
+	REQUIRE(read == 2.5);
+	REQUIRE(err == "'2,5' is not a valid number");
+	REQUIRE(written == "(service (name \"\") (timeout 2.5) (enabled false) (tags) (endpoints))");
+	REQUIRE(precise == "(service (name \"\") (timeout 0.30000000000000004) (enabled false) (tags) (endpoints))");
+
+	err.clear();
+	sexpresso::deserialize("(service (timeout -inf))", svc, err);
+	REQUIRE(err.empty());
+	REQUIRE(svc.timeout < -1e308);
+	sexpresso::deserialize("(service (timeout 2.5x))", svc, err);
+	REQUIRE(err == "'2.5x' is not a valid number");
+}
+
+TEST_CASE("Serialize structs") {
+	auto svc = TestService{};
+	svc.name = "auth api";
+	svc.timeout = 0.1;
+	svc.enabled = true;
+	svc.tags = {"fast", "tab\there"};
+	svc.endpoints.resize(1);
+	svc.endpoints[0].host = "a.local";
+	svc.endpoints[0].port = 80;
+
+	auto str = sexpresso::serialize(svc);
+	REQUIRE(str == "(service (name \"auth api\") (timeout 0.1) (enabled true) (tags fast \"tab\\there\")"
+		" (endpoints (endpoint (host a.local) (port 80))))");
+
+	auto err = std::string{};
+	auto back = TestService{};
+	sexpresso::deserialize(str, back, err);
+	REQUIRE(err.empty());
+	REQUIRE(sexpresso::serialize(back) == str);
+	REQUIRE(sexpresso::parse(str).toString() == str);
+
+	REQUIRE(sexpresso::serialize(TestEndpoint{}) == "(endpoint (host \"\") (port 0))");
+
+	svc.tags.clear();
+	svc.endpoints.clear();
+	str = sexpresso::serialize(svc);
+	REQUIRE(str == "(service (name \"auth api\") (timeout 0.1) (enabled true) (tags) (endpoints))");
+	REQUIRE(sexpresso::parse(str).toString() == str);
+}
+
+TEST_CASE("Parallel toString") {
+	auto s = sexpresso::Sexp{};
+	for(auto i = 0; i < 1000; ++i) {
+		auto& entry = s.createPath("log").createPath("entry" + std::to_string(i));
+		for(auto j = 0; j < i % 37; ++j) entry.addChild("item " + std::to_string(j));
+		s.addChild("atom" + std::to_string(i));
+	}
+	s.addChild(sexpresso::Sexp{});
+	REQUIRE(s.toStringParallel(4) == s.toString());
+	REQUIRE(s.toStringParallel() == s.toString());
+	REQUIRE(s.toStringParallel(5000) == s.toString());
+	REQUIRE(sexpresso::Sexp{}.toStringParallel(4).empty());
+}
+
+TEST_CASE("Flat representation") {
+	auto str = std::string{"(myshit (a (name me) (age 2)) (b (name \"you there\") (age 1)) lone) () tail"};
+	auto err = std::string{};
+	auto flat = sexpresso::parseFlat(str, err);
+	REQUIRE(err.empty());
+	REQUIRE(flat.toSexp().equal(sexpresso::parse(str)));
+	REQUIRE(flat.childCount(0) == 3);
+
+	auto name = flat.getChildByPath("myshit/b/name");
+	REQUIRE(name != sexpresso::FlatSexp::npos);
+	REQUIRE(flat.getString(flat.getChild(name, 1)) == "you there");
+	REQUIRE(flat.toSexp(name).toString() == "name \"you there\"");
+	REQUIRE(flat.getChildByPath("myshit/lone") != sexpresso::FlatSexp::npos);
+	REQUIRE(flat.getChildByPath("myshit/c") == sexpresso::FlatSexp::npos);
+	// An empty path names nothing, as with Sexp::getChildByPath
+	REQUIRE(sexpresso::parse(str).getChildByPath("") == nullptr);
+	REQUIRE(flat.getChildByPath("") == sexpresso::FlatSexp::npos);
+	REQUIRE(flat.getChildByPath("", name) == sexpresso::FlatSexp::npos);
+
+	auto atoms = std::vector<std::string>{};
+	for(auto child : flat.children(flat.getChildByPath("myshit/a/age"))) atoms.push_back(flat.getString(child));
+	REQUIRE(atoms.size() == 2);
+	REQUIRE(atoms[1] == "2");
+
+	sexpresso::parseFlat("(a (b)", err);
+	REQUIRE(!err.empty());
+}
+
+TEST_CASE("Queries") {
+	auto s = sexpresso::parse(
+		"(config (db (timeout 5) (host a)) (cache (timeout 1)) (web (endpoint x) (inner (endpoint y))))"
+		"(rules (rule (port 80) first) (rule (port 443)) (rule (port 80) third) (other))");
+	auto err = std::string{};
+	auto strs = [](std::vector<sexpresso::Sexp*> const& v) {
+		auto out = std::vector<std::string>{};
+		for(auto p : v) out.push_back(p->toString());
+		return out;
+	};
+
+	auto timeouts = strs(sexpresso::compileQuery("config/*/timeout", err).select(s));
+	REQUIRE(err.empty());
+	REQUIRE(timeouts.size() == 2);
+	REQUIRE(timeouts[0] == "timeout 5");
+	REQUIRE(timeouts[1] == "timeout 1");
+
+	auto endpoints = strs(sexpresso::compileQuery("**/endpoint", err).select(s));
+	REQUIRE(endpoints.size() == 2);
+	REQUIRE(endpoints[0] == "endpoint x");
+	REQUIRE(endpoints[1] == "endpoint y");
+
+	auto third = strs(sexpresso::compileQuery("rules/rule[2]", err).select(s));
+	REQUIRE(third.size() == 1);
+	REQUIRE(third[0] == "rule (port 80) third");
+
+	auto http = strs(sexpresso::compileQuery("rules/rule[port=80]", err).select(s));
+	REQUIRE(http.size() == 2);
+	REQUIRE(sexpresso::compileQuery("rules/rule[port=80][1]", err).select(s)[0]->toString() == "rule (port 80) third");
+	REQUIRE(sexpresso::compileQuery("rules/*[port]", err).select(s).size() == 3);
+	REQUIRE(sexpresso::compileQuery("config/db/host/a", err).select(s).size() == 1);
+	REQUIRE(sexpresso::compileQuery("**/nothing", err).select(s).empty());
+	REQUIRE(err.empty());
+
+	sexpresso::compileQuery("rules/rule[port", err);
+	REQUIRE(!err.empty());
+	err.clear();
+	sexpresso::compileQuery("rules//rule", err);
+	REQUIRE(!err.empty());
+}
+
+TEST_CASE("Scan queries without parsing") {
+	auto str = std::string{
+		"(config (db (timeout 5) (host a)) (cache (timeout 1)) (web (endpoint x) (inner (endpoint y))))"
+		"(rules (rule (port 80) first) (rule (port 443)) (rule (port 80) third) (other))"};
+	auto err = std::string{};
+	auto tree = sexpresso::parse(str);
+	auto queries = std::vector<sexpresso::SexpQuery>{};
+	for(auto q : {"config/*/timeout", "**/endpoint", "rules/rule[2]", "rules/rule[port=80]", "rules/*[port][1]", "config/db/host/a", "**/nothing"}) {
+		auto query = sexpresso::compileQuery(q, err);
+		auto found = std::vector<std::string>{};
+		sexpresso::scanQuery(query, str, [&found](sexpresso::Sexp& match) { found.push_back(match.toString()); }, err);
+		REQUIRE(err.empty());
+		auto expected = std::vector<std::string>{};
+		for(auto match : query.select(tree)) expected.push_back(match->toString());
+		REQUIRE(found == expected);
+		queries.push_back(query);
+	}
+	// all at once, in one pass
+	auto found = std::vector<std::vector<std::string>>(queries.size());
+	sexpresso::scanQueries(queries, str, [&found](sexpresso::Sexp& match, size_t i) { found[i].push_back(match.toString()); }, err);
+	REQUIRE(err.empty());
+	for(auto i = size_t{0}; i != queries.size(); ++i) {
+		auto expected = std::vector<std::string>{};
+		for(auto match : queries[i].select(tree)) expected.push_back(match->toString());
+		REQUIRE(found[i] == expected);
+	}
+	auto both = std::vector<size_t>{};
+	sexpresso::scanQueries({sexpresso::compileQuery("**/a", err), sexpresso::compileQuery("a", err)}, "(a x)",
+		[&both](sexpresso::Sexp&, size_t i) { both.push_back(i); }, err);
+	REQUIRE(both == (std::vector<size_t>{0, 1}));
+	auto deep = std::string{"a"};
+	for(auto i = 0; i < 40; ++i) deep += "/a";
+	auto toomany = sexpresso::SexpQueryScanner{{sexpresso::compileQuery(deep, err), sexpresso::compileQuery(deep, err)}, str};
+	REQUIRE(toomany.next() == nullptr);
+	REQUIRE(toomany.err == "too many steps in the queries together");
+
+	auto nested = std::vector<std::string>{};
+	sexpresso::scanQuery(sexpresso::compileQuery("**/a", err), "(a (a x))", [&nested](sexpresso::Sexp& match) { nested.push_back(match.toString()); }, err);
+	REQUIRE(nested.size() == 2);
+	REQUIRE(nested[0] == "a x");
+
+	// The scanner points into its input, so temporaries are refused
+	static_assert(!std::is_constructible<sexpresso::SexpQueryScanner, sexpresso::SexpQuery, std::string&&>::value, "no temporaries");
+	static_assert(!std::is_constructible<sexpresso::Lexer, std::string&&>::value, "no temporaries");
+	auto broken = std::string{"(rule 1) (rule"};
+	auto scanner = sexpresso::SexpQueryScanner{sexpresso::compileQuery("rule", err), broken};
+	REQUIRE(scanner.next() != nullptr);
+	REQUIRE(scanner.next() == nullptr);
+	REQUIRE(!scanner.err.empty());
+}
+
+TEST_CASE("Pattern matching") {
+	auto err = std::string{};
+	auto define = sexpresso::compilePattern("(define ?name (lambda ?args ?body...))", err);
+	REQUIRE(err.empty());
+	REQUIRE(define.names.size() == 3);
+	auto captures = std::vector<sexpresso::SexpCapture>{};
+	auto s = sexpresso::parse("(define sq (lambda (x) (log x) (* x x)))");
+	REQUIRE(define.match(s.getChild(0), captures));
+	REQUIRE(captures[define.slot("name")].first->toString() == "sq");
+	REQUIRE(captures[define.slot("args")].first->toString() == "x");
+	auto& body = captures[define.slot("body")];
+	REQUIRE(body.last - body.first == 2);
+	REQUIRE(body.first[1].toString() == "* x x");
+	REQUIRE(!define.match(sexpresso::parse("(define sq)").getChild(0), captures));
+	REQUIRE(!define.match(sexpresso::parse("(defun sq (lambda (x)))").getChild(0), captures));
+
+	auto middle = sexpresso::compilePattern("(call ?fn ?args... end)", err);
+	REQUIRE(middle.match(sexpresso::parse("(call f end)").getChild(0), captures));
+	REQUIRE(captures[1].first == captures[1].last);
+	REQUIRE(!middle.match(sexpresso::parse("(call f 1 2)").getChild(0), captures));
+
+	sexpresso::compilePattern("(a ?x ?x)", err);
+	REQUIRE(!err.empty());
+	err.clear();
+	sexpresso::compilePattern("(a ?x... ?y...)", err);
+	REQUIRE(!err.empty());
+	err.clear();
+
+	auto dispatcher = sexpresso::SexpDispatcher{};
+	for(auto p : {"(set ?key ?value)", "(get ?key)", "(set ?key)", "(log ?parts...)", "(?op ?x)", "(get ?key ?default)"}) {
+		dispatcher.add(sexpresso::compilePattern(p, err));
+	}
+	REQUIRE(err.empty());
+	REQUIRE(dispatcher.match(sexpresso::parse("(set a 1)").getChild(0), captures) == 0);
+	REQUIRE(dispatcher.match(sexpresso::parse("(get a)").getChild(0), captures) == 1);
+	REQUIRE(dispatcher.match(sexpresso::parse("(set a)").getChild(0), captures) == 2);
+	REQUIRE(dispatcher.match(sexpresso::parse("(log a b c)").getChild(0), captures) == 3);
+	REQUIRE(dispatcher.match(sexpresso::parse("(log a)").getChild(0), captures) == 3);
+	auto del = sexpresso::parse("(del a)");
+	REQUIRE(dispatcher.match(del.getChild(0), captures) == 4);
+	REQUIRE(captures[0].first->toString() == "del");
+	REQUIRE(dispatcher.match(sexpresso::parse("(get a b)").getChild(0), captures) == 5);
+	REQUIRE(dispatcher.match(sexpresso::parse("(del a b)").getChild(0), captures) == std::string::npos);
+}
+
+TEST_CASE("Transform") {
+	auto s = sexpresso::parse("(begin (comment drop me) (+ 1 2) (begin (print (+ 3 (+ 4 5))) (comment x)) (quote (+ 1 1)))");
+	auto visited = 0;
+	sexpresso::transform(s, [&visited](sexpresso::Sexp& node) {
+		++visited;
+		auto head = node.isSexp() && node.childCount() > 0 && node.getChild(0).isString() ? node.getChild(0).value.str : std::string{};
+		if(head == "comment") return sexpresso::SexpAction::REMOVE;
+		if(head == "quote") return sexpresso::SexpAction::SKIP;
+		if(head == "begin") {
+			node.value.sexp.erase(node.value.sexp.begin());
+			return sexpresso::SexpAction::SPLICE;
+		}
+		return sexpresso::SexpAction::KEEP;
+	}, [](sexpresso::Sexp& node) {
+		if(node.isSexp() && node.childCount() == 3 && node.getChild(0).value.str == "+" && node.getChild(1).isString() && node.getChild(2).isString()) {
+			node = sexpresso::Sexp{std::to_string(std::stoi(node.getChild(1).value.str) + std::stoi(node.getChild(2).value.str))};
+		}
+		return sexpresso::SexpAction::KEEP;
+	});
+	REQUIRE(s.toString() == "3 (print 12) (quote (+ 1 1))");
+	REQUIRE(visited > 0);
+
+	auto splice = sexpresso::parse("a (b c (d) e) f");
+	sexpresso::transform(splice, [](sexpresso::Sexp&) { return sexpresso::SexpAction::KEEP; }, [](sexpresso::Sexp& node) {
+		if(node.isSexp() && node.childCount() > 0 && node.getChild(0).value.str == "b") return sexpresso::SexpAction::SPLICE;
+		if(node.isString() && node.value.str == "d") return sexpresso::SexpAction::REMOVE;
+		return sexpresso::SexpAction::KEEP;
+	});
+	REQUIRE(splice.toString() == "a b c () e f");
+
+	// Replacing a node with one of its own children
+	auto unwrap = sexpresso::parse("(progn (f (progn x))) (progn (a b)) (progn a-symbol-too-long-for-the-small-string-buffer)");
+	sexpresso::transform(unwrap, [](sexpresso::Sexp&) { return sexpresso::SexpAction::KEEP; }, [](sexpresso::Sexp& node) {
+		if(node.isSexp() && node.childCount() == 2 && node.getChild(0).value.str == "progn") node = std::move(node.getChild(1));
+		return sexpresso::SexpAction::KEEP;
+	});
+	REQUIRE(unwrap.toString() == "(f x) (a b) a-symbol-too-long-for-the-small-string-buffer");
+
+	auto deep = sexpresso::Sexp{};
+	auto node = &deep;
+	for(auto i = 0; i < 100000; ++i) {
+		node->addChild(sexpresso::Sexp{"x"});
+		node->addChild(sexpresso::Sexp{});
+		node = &node->value.sexp.back();
+	}
+	auto count = 0;
+	sexpresso::transform(deep, [](sexpresso::Sexp&) { return sexpresso::SexpAction::KEEP; }, [&count](sexpresso::Sexp& node) {
+		++count;
+		return node.isString() ? sexpresso::SexpAction::REMOVE : sexpresso::SexpAction::KEEP;
+	});
+	REQUIRE(count == 200001);
+	REQUIRE(deep.childCount() == 1);
+}
+
+TEST_CASE("Parallel algorithms") {
+	auto s = sexpresso::Sexp{"numbers"};
+	s = sexpresso::Sexp{std::vector<sexpresso::Sexp>{s}};
+	for(auto i = 1; i <= 1000; ++i) {
+		auto item = sexpresso::Sexp{std::to_string(i)};
+		if(i % 100 == 0) { // a few much bigger ones to give the workers something to steal
+			item = sexpresso::Sexp{std::vector<sexpresso::Sexp>{item}};
+			for(auto j = 0; j < 1000; ++j) item.addChild("x");
+		}
+		s.addChild(item);
+	}
+	auto value = [](sexpresso::Sexp const& node) {
+		return std::stol(node.isString() ? node.value.str : node.value.sexp[0].value.str);
+	};
+	auto plus = [](long a, long b) { return a + b; };
+	REQUIRE(sexpresso::parallelReduce(s.arguments(), 0L, value, plus, 4) == 500500);
+
+	sexpresso::parallelTransform(s.arguments(), [&value](sexpresso::Sexp const& node) {
+		return sexpresso::Sexp{std::to_string(value(node) * 2)};
+	}, 4);
+	REQUIRE(s.childCount() == 1001);
+	REQUIRE(s.getChild(100).value.str == "200");
+	REQUIRE(sexpresso::parallelReduce(s.arguments(), 0L, value, plus, 4) == 1001000);
+
+	auto nested = sexpresso::parse("(a (b c (d e)) f (g (h (i j k))))");
+	sexpresso::parallelForEachNode(nested, [](sexpresso::Sexp& node) {
+		if(node.isString()) node.value.str += "!";
+	}, 3);
+	REQUIRE(nested.toString() == "(a! (b! c! (d! e!)) f! (g! (h! (i! j! k!))))");
+	auto atoms = sexpresso::parallelReduceNodes(nested, 0, [](sexpresso::Sexp const& node) { return node.isString() ? 1 : 0; }, [](int a, int b) { return a + b; }, 3);
+	REQUIRE(atoms == 11);
+
+	// fn may grow the list it gets, its children are read after it returns
+	auto text = std::string{};
+	for(auto i = 0; i < 50; ++i) text += "(a (b c (d e)) f (g (h (i j k)))) ";
+	auto grown = sexpresso::parse(text);
+	auto expected = grown;
+	auto grow = [](sexpresso::Sexp& node) {
+		if(node.isSexp()) node.value.sexp.push_back(sexpresso::Sexp{"+"});
+	};
+	sexpresso::visitNodes(expected, grow);
+	sexpresso::parallelForEachNode(grown, grow, 3);
+	REQUIRE(grown == expected);
+}
+
+TEST_CASE("Comparison and hashing") {
+	auto a = sexpresso::parse("(x (y 1) z)");
+	auto b = sexpresso::parse("(x  (y 1)\nz)");
+	REQUIRE(a == b);
+	REQUIRE(!(a != b));
+	REQUIRE(a.hash() == b.hash());
+	REQUIRE(a.compare(b) == 0);
+
+	auto sorted = std::vector<std::string>{"a", "\"a b\"", "b", "()", "(a)", "(a a)", "(a (a))", "(b)", "((a))"};
+	auto trees = std::vector<sexpresso::Sexp>{};
+	for(auto& str : sorted) trees.push_back(sexpresso::parse(str).getChild(0));
+	for(auto i = 0u; i < trees.size(); ++i) {
+		for(auto j = 0u; j < trees.size(); ++j) {
+			REQUIRE((trees[i] < trees[j]) == (i < j));
+			REQUIRE((trees[i] == trees[j]) == (i == j));
+		}
+	}
+	REQUIRE(sexpresso::parse("(a b) c").hash() != sexpresso::parse("(a) b c").hash());
+}
+
+TEST_CASE("Sorted children") {
+	auto s = sexpresso::parse("(settings (zeta 1) (alpha 2) flag (mid (inner 3)) () (alpha 4) (\"str head\" 5))");
+	auto& settings = s.getChild(0);
+	settings.sortChildren();
+	REQUIRE(settings.sorted);
+	REQUIRE(settings.toString() == "settings () (alpha 2) (alpha 4) flag (mid (inner 3)) (\"str head\" 5) (zeta 1)");
+	REQUIRE(settings.getChildByPath("settings") == &settings.getChild(0));
+	REQUIRE(settings.getChildByPath("alpha")->toString() == "alpha 2");
+	REQUIRE(settings.getChildByPath("mid/inner")->toString() == "inner 3");
+	REQUIRE(settings.getChildByPath("flag")->toString() == "flag");
+	REQUIRE(settings.getChildByPath("flag/x") == nullptr);
+	REQUIRE(settings.getChildByPath("nope") == nullptr);
+
+	settings.addChild(sexpresso::Sexp{std::vector<sexpresso::Sexp>{sexpresso::Sexp{"beta"}}});
+	auto& created = settings.createPath("gamma/delta");
+	created.addChild("6");
+	REQUIRE(settings.toString() == "settings () (alpha 2) (alpha 4) (beta) flag (gamma (delta 6)) (mid (inner 3)) (\"str head\" 5) (zeta 1)");
+	REQUIRE(settings.getChildByPath("gamma/delta")->toString() == "delta 6");
+
+	auto big = sexpresso::Sexp{};
+	for(auto i = 0; i < 20000; ++i) big.addChild(sexpresso::Sexp{std::vector<sexpresso::Sexp>{sexpresso::Sexp{std::to_string(i * 7919 % 10007)}, sexpresso::Sexp{std::to_string(i)}}});
+	auto serial = big;
+	serial.sortChildren();
+	big.sortChildren(4);
+	REQUIRE(big == serial);
+	REQUIRE(big.getChildByPath("42") != nullptr);
+	REQUIRE(std::is_sorted(big.value.sexp.begin(), big.value.sexp.end(), [](sexpresso::Sexp const& a, sexpresso::Sexp const& b) {
+		return a.getChild(0).value.str < b.getChild(0).value.str;
+	}));
+}
+
+TEST_CASE("Sorted flag after library edits") {
+	auto isHead = [](sexpresso::Sexp const& node, std::string const& name) {
+		return node.isSexp() && !node.value.sexp.empty() && node.value.sexp[0].isString() && node.value.sexp[0].value.str == name;
+	};
+	auto keep = [](sexpresso::Sexp&) { return sexpresso::SexpAction::KEEP; };
+
+	auto s = sexpresso::parse("(list (c 4) (b 1) (grp (a 2) (z 3)))");
+	auto& list = s.getChild(0);
+	list.sortChildren();
+	sexpresso::transform(list, [&](sexpresso::Sexp& node) {
+		return isHead(node, "grp") ? sexpresso::SexpAction::SPLICE : sexpresso::SexpAction::KEEP;
+	}, keep);
+	REQUIRE(list.toString() == "list (b 1) (c 4) grp (a 2) (z 3)");
+	REQUIRE_FALSE(list.sorted);
+	REQUIRE(list.getChildByPath("a")->toString() == "a 2");
+
+	// Replacing a child keeps the flag only if the order still holds
+	auto rename = [&](std::string const& from, std::string const& to) {
+		return [&isHead, from, to](sexpresso::Sexp& node) {
+			if(isHead(node, from)) node.value.sexp[0].value.str = to;
+			return sexpresso::SexpAction::KEEP;
+		};
+	};
+	s = sexpresso::parse("(list (b 1) (c 2) (d 3))");
+	auto& renamed = s.getChild(0);
+	renamed.sortChildren();
+	sexpresso::transform(renamed, rename("c", "cc"), keep);
+	REQUIRE(renamed.sorted);
+	sexpresso::transform(renamed, rename("b", "x"), keep);
+	REQUIRE_FALSE(renamed.sorted);
+	REQUIRE(renamed.getChildByPath("x")->toString() == "x 1");
+
+	s = sexpresso::parse("(list (b 1) (c 2) (d 3))");
+	auto& parallel = s.getChild(0);
+	parallel.sortChildren();
+	sexpresso::parallelTransform(parallel.arguments(), [](sexpresso::Sexp const& arg) {
+		return sexpresso::Sexp{std::vector<sexpresso::Sexp>{sexpresso::Sexp{arg.getChild(1).value.str}, arg.getChild(0)}};
+	}, 2);
+	REQUIRE(parallel.sorted);
+	REQUIRE(parallel.getChildByPath("2")->toString() == "2 c");
+
+	// A reparse that renames a head can leave the list above it out of order
+	auto text = std::string{"(s (b 1) (c 2))"};
+	auto err = std::string{};
+	auto errpos = sexpresso::SexpPosition{};
+	auto spans = std::vector<sexpresso::SexpSpan>{};
+	auto tree = sexpresso::parse(text, err, errpos, spans);
+	tree.getChild(0).sortChildren();
+	sexpresso::reparse(text, tree, spans, sexpresso::SexpEdit{4, 1, "x"}, err);
+	REQUIRE(err.empty());
+	REQUIRE(tree.toString() == "(s (x 1) (c 2))");
+	REQUIRE_FALSE(tree.getChild(0).sorted);
+	REQUIRE(tree.getChildByPath("s/x")->toString() == "x 1");
+
+	// parseInto turning a sorted list into an atom clears the flag
+	auto parser = sexpresso::Parser{};
+	auto target = sexpresso::Sexp{};
+	parser.parseInto(target, "(m (b) (a))", err);
+	target.getChild(0).sortChildren();
+	parser.parseInto(target, "m", err);
+	REQUIRE(target.getChild(0).isString());
+	REQUIRE_FALSE(target.getChild(0).sorted);
+}
+
+TEST_CASE("Path cache") {
+	auto config = sexpresso::parse("(server (port 80) (host a)) (db (url x))");
+	auto cache = sexpresso::SexpPathCache{config};
+	auto port = cache.getChildByPath("server/port");
+	REQUIRE(port == config.getChildByPath("server/port"));
+	REQUIRE(cache.getChildByPath("server/port") == port);
+	REQUIRE(cache.getChildByPath("server/missing") == nullptr);
+	for(auto i = 0; i < 100; ++i) cache.getChildByPath("db/url/" + std::to_string(i));
+	REQUIRE(cache.count == 102);
+	REQUIRE(cache.getChildByPath("db/url")->toString() == "url x");
+
+	auto generation = sexpresso::treeGeneration();
+	auto const& view = config;
+	view.getChildByPath("db");
+	REQUIRE(sexpresso::treeGeneration() == generation);
+	config.createPath("server/missing").addChild("1");
+	REQUIRE(sexpresso::treeGeneration() != generation);
+	REQUIRE(cache.getChildByPath("server/missing")->toString() == "missing 1");
+	REQUIRE(cache.count == 1);
+
+	config = sexpresso::parse("(server (port 81))");
+	REQUIRE(cache.getChildByPath("server/port")->toString() == "port 81");
+
+	// Lookups through non-const references don't write anything, so threads can share
+	// the tree
+	generation = sexpresso::treeGeneration();
+	auto lookups = [&config] {
+		for(auto i = 0; i < 1000; ++i) config.getChildByPath("server/port")->getChild(1).getString();
+	};
+	auto other = std::thread{lookups};
+	lookups();
+	other.join();
+	REQUIRE(sexpresso::treeGeneration() == generation);
+
+	// Changes below the root, through getChild or a pointer kept from earlier, are
+	// noticed too
+	REQUIRE(cache.getChildByPath("server/port")->toString() == "port 81");
+	REQUIRE(cache.getChildByPath("server/host") == nullptr);
+	for(auto i = 0; i < 100; ++i) config.getChild(0).addChild("x");
+	REQUIRE(cache.getChildByPath("server/port")->toString() == "port 81");
+	auto server = config.getChildByPath("server");
+	server->addChild(sexpresso::Sexp{std::vector<sexpresso::Sexp>{sexpresso::Sexp{"host"}, sexpresso::Sexp{"b"}}});
+	REQUIRE(cache.getChildByPath("server/host")->toString() == "host b");
+
+	auto copy = cache;
+	config.getChild(0).value.sexp[1].addChild("81");
+	REQUIRE(copy.getChildByPath("server/port")->toString() == "port 81 81");
+
+	// createPaths and parallelTransform change the tree too
+	auto index = sexpresso::SexpPathIndex{config};
+	REQUIRE(cache.getChildByPath("new/a") == nullptr);
+	auto paths = std::vector<std::vector<std::string>>{};
+	for(auto i = 0; i < 100; ++i) paths.push_back({"new", std::to_string(i)});
+	paths.push_back({"new", "a"});
+	index.createPaths(paths);
+	REQUIRE(cache.getChildByPath("new/a") == config.getChildByPath("new/a"));
+	REQUIRE(cache.getChildByPath("new/a") != nullptr);
+	auto& added = *config.getChildByPath("new");
+	REQUIRE(cache.getChildByPath("new/5")->toString() == "5");
+	generation = sexpresso::treeGeneration();
+	sexpresso::parallelTransform(added.arguments(), [](sexpresso::Sexp const& arg) {
+		return sexpresso::Sexp{std::vector<sexpresso::Sexp>{arg.getChild(0), sexpresso::Sexp{"set"}}};
+	}, 2);
+	REQUIRE(sexpresso::treeGeneration() != generation);
+	REQUIRE(cache.getChildByPath("new/5")->toString() == "5 set");
+}
+
+TEST_CASE("Node pool") {
+	sexpresso::enableNodePool(true);
+	auto state = sexpresso::Sexp{};
+	for(auto i = 0; i < 5000; ++i) {
+		auto item = sexpresso::Sexp{};
+		item.addChild("a-key-that-does-not-fit-in-small-strings-" + std::to_string(i));
+		for(auto j = 0; j < i % 7; ++j) item.addChild(std::to_string(j));
+		state.addChild(std::move(item));
+		if(state.childCount() > 100) state.value.sexp.erase(state.value.sexp.begin() + 10, state.value.sexp.begin() + 60);
+	}
+	auto copy = sexpresso::parse(state.toString());
+	REQUIRE(copy == state);
+	REQUIRE(state.getChild(state.childCount() - 1).toString() == "a-key-that-does-not-fit-in-small-strings-4999 0");
+
+	// Parsing takes its lists and atoms from what earlier trees left behind
+	auto text = std::string{"(entry-with-a-long-name (user \"someone with a long name\") (flags a b c)) "};
+	for(auto i = 0; i < 6; ++i) text += text;
+	auto parser = sexpresso::Parser{};
+	auto err = std::string{};
+	auto expected = sexpresso::parse(text);
+	for(auto round = 0; round < 3; ++round) {
+		auto tree = parser.parse(text);
+		REQUIRE(tree == expected);
+		auto into = sexpresso::parse("(x (y z) \"a string that is long enough\")");
+		parser.parseInto(into, text, err);
+		REQUIRE(into == expected);
+	}
+	sexpresso::enableNodePool(false);
+	state.addChild("still fine");
+	REQUIRE(state.getChild(state.childCount() - 1).value.str == "still fine");
+}
+
+TEST_CASE("Flatten snapshots") {
+	auto tree = sexpresso::parse("(state (user \"a b\" 3) () (nested (deeper (deepest x))) sym\\\\bol) tail");
+	auto flat = sexpresso::flatten(tree);
+	REQUIRE(flat.size() == 17);
+	REQUIRE(flat.toSexp() == tree);
+	auto parsed = sexpresso::parseFlat(tree.toString());
+	REQUIRE(flat.kinds == parsed.kinds);
+	REQUIRE(flat.sizes == parsed.sizes);
+	REQUIRE(flat.offsets == parsed.offsets);
+	REQUIRE(flat.pool == parsed.pool);
+	REQUIRE(flat.getString(flat.getChildByPath("state/user", 0) + 2) == "a b");
+	REQUIRE(sexpresso::flatten(sexpresso::Sexp{"atom"}).toSexp() == sexpresso::Sexp{"atom"});
+}
+
+TEST_CASE("Incremental reparse") {
+	auto text = std::string{"(config\n  (server (host \"a b\") (port 80))\n  ; note\n  (rules (rule x) (rule y)))\n(tail 1)"};
+	auto err = std::string{};
+	auto pos = sexpresso::SexpPosition{};
+	auto spans = std::vector<sexpresso::SexpSpan>{};
+	auto tree = sexpresso::parse(text, err, pos, spans);
+	auto edit = [&](size_t offset, size_t removed, std::string inserted) {
+		err.clear();
+		sexpresso::reparse(text, tree, spans, sexpresso::SexpEdit{offset, removed, inserted}, err);
+		auto experr = std::string{};
+		auto expspans = std::vector<sexpresso::SexpSpan>{};
+		auto expected = sexpresso::parse(text, experr, pos, expspans);
+		REQUIRE(err == experr);
+		REQUIRE(tree == expected);
+		REQUIRE(spans.size() == expspans.size());
+		for(auto i = size_t{0}; i != spans.size(); ++i) {
+			REQUIRE(spans[i].begin == expspans[i].begin);
+			REQUIRE(spans[i].end == expspans[i].end);
+		}
+	};
+	edit(text.find("80"), 2, "8080"); // inside an atom
+	edit(text.find("(rule y)"), 0, "(rule w) "); // a new child
+	edit(text.find("; note"), 6, "(extra"); // unbalanced, the enclosing list changes shape
+	edit(text.find("(extra"), 6, "; (x"); // a comment eating a child
+	edit(0, 0, ")"); // an error
+	REQUIRE(spans.empty());
+	edit(0, 1, ""); // and back
+	edit(text.size(), 0, " (more \"text\")");
+	REQUIRE(tree.getChildByPath("config/server/port")->getChild(1).value.str == "8080");
+}
+
+TEST_CASE("Binary images") {
+	auto text = std::string{"(rules (rule (name \"a b\") (match x y)) () (rule (name c))) (tail sym\\\\bol)"};
+	auto bytes = sexpresso::toImage(sexpresso::parseFlat(text));
+	auto err = std::string{};
+	auto image = sexpresso::viewImage(bytes.data(), bytes.size(), err);
+	REQUIRE(err.empty());
+	REQUIRE(image.size() == sexpresso::parseFlat(text).size());
+	REQUIRE(image.toString() == sexpresso::parse(text).toString());
+	REQUIRE(image.toSexp() == sexpresso::parse(text));
+	auto rule = image.getChildByPath("rules/rule");
+	REQUIRE(image.toString(rule) == "rule (name \"a b\") (match x y)");
+	auto args = std::vector<std::string>{};
+	for(auto arg : image.arguments(rule)) args.push_back(image.toString(arg));
+	REQUIRE(args == (std::vector<std::string>{"name \"a b\"", "match x y"}));
+	REQUIRE(image.getString(image.getChildByPath("rules/rule/name") + 2) == "a b");
+	REQUIRE(image.getChildByPath("rules/nothing") == sexpresso::FlatSexp::npos);
+	REQUIRE(image.getChildByPath("") == sexpresso::FlatSexp::npos);
+	REQUIRE(image.getChildByPath("", rule) == sexpresso::FlatSexp::npos);
+
+	sexpresso::viewImage(bytes.data(), bytes.size() - 1, err);
+	REQUIRE(err == "the image is truncated or corrupt");
+	// Section offsets are 64 bit, at bytes 16 to 48. One past 4 GiB doesn't wrap around
+	// to a place inside the image.
+	auto forged = bytes;
+	auto pool = uint64_t{};
+	std::memcpy(&pool, &forged[40], sizeof pool);
+	pool += uint64_t{1} << 32;
+	std::memcpy(&forged[40], &pool, sizeof pool);
+	sexpresso::viewImage(forged.data(), forged.size(), err);
+	REQUIRE(err == "the image is truncated or corrupt");
+	forged = bytes;
+	forged[4] = 2;
+	sexpresso::viewImage(forged.data(), forged.size(), err);
+	REQUIRE(err == "unsupported image version 2");
+	auto text_as_image = std::string{"(this is not an image at all, just some text that is long enough)"};
+	sexpresso::viewImage(text_as_image.data(), text_as_image.size(), err);
+	REQUIRE(err == "not an image, or written on a machine with a different byte order");
+}
+
+TEST_CASE("Bytes above 127 and every kind of space") {
+	auto s = sexpresso::parse("caf\xc3\xa9\t\xff(\xa0x)\v\f\r\ny ;\xe2\x80\x94 comment\rz");
+	REQUIRE(s.childCount() == 5);
+	REQUIRE(s.getChild(0).value.str == "caf\xc3\xa9");
+	REQUIRE(s.getChild(1).value.str == "\xff");
+	REQUIRE(s.getChild(2).getChild(0).value.str == "\xa0x");
+	REQUIRE(s.getChild(3).value.str == "y");
+	REQUIRE(s.getChild(4).value.str == "z");
+
+	// The compile time literal check and the parser agree on which escapes exist
+	static_assert(sexpresso::validLiteral("\"\\a\\v\\?\\'\""), "known escapes");
+	static_assert(!sexpresso::validLiteral("\"\\x\""), "unknown escape");
+	for(auto c = 0; c < 256; ++c) {
+		auto err = std::string{};
+		sexpresso::parse(std::string{"\"\\"} + char(c) + '"', err);
+		REQUIRE(err.empty() == sexpresso::hasCharClass(char(c), sexpresso::char_escape_char));
+	}
+}
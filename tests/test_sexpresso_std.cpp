@@ -9,9 +9,12 @@
 #include "sexpresso.hpp"
 
 #include <ostream>
+#include <istream>
+#include <functional>
 #include "sexpresso_std.hpp"
 
 #include <sstream>
+#include <unordered_map>
 
 using namespace sexpresso_std;
 
@@ -25,3 +28,66 @@ TEST_CASE("<< operator") {
 	REQUIRE(ss.str() == "wow (hello everybody (we will (shortly do) (some (stuff))) \"\")");
 	
 }
+
+TEST_CASE("Read forms from a stream") {
+	auto input = std::string{"; header\n(first (a b)) second \"third one\"\n(fourth\n  (nested \"a b)\" x;y)) ; trailing comment"};
+	auto ss = std::istringstream{input};
+	auto forms = std::vector<std::string>{};
+	auto reader = readForms(ss);
+	for(auto& form : reader) {
+		forms.push_back(form.toString());
+	}
+	REQUIRE(reader.err.empty());
+	REQUIRE(forms.size() == 4);
+	REQUIRE(forms[0] == "first (a b)");
+	REQUIRE(forms[1] == "second");
+	REQUIRE(forms[2] == "\"third one\"");
+	REQUIRE(forms[3] == "fourth (nested \"a b)\" x;y)");
+}
+
+TEST_CASE("Read forms larger than a chunk") {
+	auto input = std::string{};
+	for(auto i = 0; i < 50000; ++i) input += "(entry " + std::to_string(i) + ") ";
+	input += "(big";
+	for(auto i = 0; i < 50000; ++i) input += " item";
+	input += ")";
+	auto ss = std::istringstream{input};
+	auto count = 0;
+	auto last = sexpresso::Sexp{};
+	for(auto& form : readForms(ss)) {
+		++count;
+		last = form;
+	}
+	REQUIRE(count == 50001);
+	REQUIRE(last.childCount() == 50001);
+}
+
+TEST_CASE("Read forms stops at errors") {
+	auto ss = std::istringstream{"(ok) (broken"};
+	auto reader = readForms(ss);
+	auto count = 0;
+	for(auto it = reader.begin(); it != reader.end(); ++it) ++count;
+	REQUIRE(count == 1);
+	REQUIRE(!reader.err.empty());
+}
+
+TEST_CASE("Read forms stops at a newline in a string") {
+	auto input = std::string{"(ok) (bad \"oops\n"};
+	for(auto i = 0; i < 100000; ++i) input += "(more input) ";
+	auto ss = std::istringstream{input};
+	auto reader = readForms(ss);
+	auto count = 0;
+	for(auto it = reader.begin(); it != reader.end(); ++it) ++count;
+	REQUIRE(count == 1);
+	REQUIRE(reader.err == "Unexpected newline in string literal");
+	REQUIRE(reader.buffer.size() < input.size() / 4);
+}
+
+TEST_CASE("Trees as unordered_map keys") {
+	auto cache = std::unordered_map<sexpresso::Sexp, int>{};
+	cache[sexpresso::parse("(query (select a b) (from t))")] = 1;
+	cache[sexpresso::parse("(query (select a) (from t))")] = 2;
+	REQUIRE(cache.size() == 2);
+	REQUIRE(cache.at(sexpresso::parse("(query  (select a b)\n (from t))")) == 1);
+	REQUIRE(cache.count(sexpresso::parse("(query (select a) (b from t))")) == 0);
+}